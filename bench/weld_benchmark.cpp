@@ -0,0 +1,110 @@
+// times weld_vertices against the unordered_map<Vert, u32> welding load_obj used before.
+// usage: weld_benchmark [mesh.obj] [runs], without an obj a 1000x1000 quad grid (2M triangles) is generated
+#include "MeshWeld.h"
+#include "Scene.h"
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <unordered_map>
+
+namespace std {
+  template<> struct hash<Vert> {
+    size_t operator()(Vert const& vertex) const {
+      return ((hash<glm::vec3>()(vertex.pos) ^
+	       (hash<glm::vec3>()(vertex.normal) << 1)) >> 1) ^
+	(hash<glm::vec2>()(vertex.uv) << 1);
+    }
+  };
+}
+
+// the previous load_obj loop, hashing the whole vertex with two lookups per corner
+static void weld_unordered_map(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes, std::vector<Vert>& vertices, std::vector<u32>& indices) {
+  std::unordered_map<Vert, u32> unique_vertices{};
+  for (const auto& shape : shapes) {
+    for (size_t c = 0; c < shape.mesh.num_face_vertices.size()*3; ++c) {
+      const tinyobj::index_t& idx = shape.mesh.indices[c];
+      Vert vert{};
+      vert.pos = { attrib.vertices[3*idx.vertex_index + 0], attrib.vertices[3*idx.vertex_index + 1], attrib.vertices[3*idx.vertex_index + 2] };
+      if (idx.normal_index >= 0) vert.normal = { attrib.normals[3*idx.normal_index + 0], attrib.normals[3*idx.normal_index + 1], attrib.normals[3*idx.normal_index + 2] };
+      if (idx.texcoord_index >= 0) vert.uv = { attrib.texcoords[2*idx.texcoord_index + 0], 1-attrib.texcoords[2*idx.texcoord_index + 1] };
+
+      if (unique_vertices.count(vert) == 0) {
+	unique_vertices[vert] = (u32) vertices.size();
+	vertices.push_back(vert);
+      }
+      indices.push_back(unique_vertices[vert]);
+    }
+  }
+}
+
+static std::string make_grid(u32 size) {
+  std::ostringstream obj;
+  for (u32 y = 0; y <= size; ++y)
+    for (u32 x = 0; x <= size; ++x) obj << "v " << x << " 0 " << y << "\nvt " << (float) x/size << " " << (float) y/size << "\n";
+  obj << "vn 0 1 0\n";
+  for (u32 y = 0; y < size; ++y) {
+    for (u32 x = 0; x < size; ++x) {
+      u32 a = y*(size + 1) + x + 1, b = a + 1, c = a + size + 1, d = c + 1;
+      obj << "f " << a << "/" << a << "/1 " << b << "/" << b << "/1 " << d << "/" << d << "/1\n";
+      obj << "f " << a << "/" << a << "/1 " << d << "/" << d << "/1 " << c << "/" << c << "/1\n";
+    }
+  }
+  return obj.str();
+}
+
+template <typename F>
+static double best_of(u32 runs, F&& weld, std::vector<Vert>& vertices, std::vector<u32>& indices) {
+  double best = 1e30;
+  for (u32 r = 0; r < runs; ++r) {
+    vertices.clear();
+    indices.clear();
+    auto start = std::chrono::high_resolution_clock::now();
+    weld(vertices, indices);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  u32 runs = argc > 2 ? (u32) std::max(1, atoi(argv[2])) : 5;
+
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+  bool loaded;
+  if (argc > 1) {
+    loaded = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, argv[1]);
+  } else {
+    std::istringstream grid(make_grid(1000));
+    loaded = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, &grid);
+  }
+  if (!loaded) {
+    err_log("Failed to load mesh, {}", err);
+    return 1;
+  }
+
+  size_t triangles = 0;
+  for (const auto& shape : shapes) triangles += shape.mesh.num_face_vertices.size();
+  info_log("{} triangles, best of {} runs", triangles, runs);
+
+  std::vector<Vert> map_vertices, table_vertices;
+  std::vector<u32> map_indices, table_indices;
+  double map_ms = best_of(runs, [&](auto& v, auto& i) { weld_unordered_map(attrib, shapes, v, i); }, map_vertices, map_indices);
+  double table_ms = best_of(runs, [&](auto& v, auto& i) { weld_vertices(attrib, shapes, v, i); }, table_vertices, table_indices);
+  info_log("unordered_map<Vert, u32>: {:.1f}ms, {} vertices", map_ms, map_vertices.size());
+  info_log("weld_vertices:            {:.1f}ms, {} vertices", table_ms, table_vertices.size());
+
+  // the index triple only merges corners the obj already shares, so the counts can differ on meshes
+  // that repeat identical attributes under different indices. the welded triangles must match either way
+  bool same = map_indices.size() == table_indices.size();
+  for (size_t i = 0; same && i < map_indices.size(); ++i) same = map_vertices[map_indices[i]] == table_vertices[table_indices[i]];
+  if (!same) {
+    err_log("welded triangles differ");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "Common.h"
+#include "VkInclude.h"
+#include <string>
+#include <vector>
+
+struct Blas;
+struct GeometryData;
+
+// on disk cache of serialized blases. an entry is keyed on a hash of the mesh data and the build flags,
+// the driver decides whether a serialized blas is compatible (driver and device uuid in its header)
+namespace AccelCache {
+  constexpr u32 VERSION = 2; // bump whenever the key or the file layout changes
+  inline std::string cache_dir = "accel_cache";
+
+  u64 blas_key(const GeometryData& geometry, VkBuildAccelerationStructureFlagsKHR build_flags);
+
+  // deserializes every blas with a compatible entry, returns the indices that still need a build
+  std::vector<u32> load(Blas* blases, const u64* keys, u32 count);
+  void store(Blas* blases, const u64* keys, u32 count);
+};
@@ -0,0 +1,9 @@
+#pragma once
+#include "Common.h"
+
+// cpu block compression of rgba8 images. blocks on the right and bottom edge repeat the last texel,
+// so any size works. out receives one 16 byte block per 4x4 texels, rows of blocks back to back
+namespace BcEncoder {
+  void encode_bc7(const u8* rgba, u32 width, u32 height, u8* out); // mode 6 only, one subset with alpha
+  void encode_bc5(const u8* rgba, u32 width, u32 height, u8* out); // red and green channels
+};
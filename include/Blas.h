@@ -9,18 +9,27 @@ struct AccelStructureGeometry {
 };
 
 struct AccelStructure {
-  VkAccelerationStructureKHR accel;
+  VkAccelerationStructureKHR accel { VK_NULL_HANDLE };
   AllocatedBuffer buffer;
+  VkDeviceSize size {0};
 
   void create(VkAccelerationStructureCreateInfoKHR& create_info, VmaMemoryUsage mem_usage = VMA_MEMORY_USAGE_GPU_ONLY);
+  void destroy();
 };
 
 struct Blas {
   AccelStructure accel_structure;
   AccelStructureGeometry geometry_info;
 
-  void add_buffers(AllocatedBuffer& vbo, AllocatedBuffer& ibo, u32 max_vertices, u32 max_indices);
-  static void build_blas(Blas* blases, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags=VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+  void add_buffers(AllocatedBuffer& vbo, AllocatedBuffer& ibo, u32 max_vertices, u32 max_indices, u32 first_vertex = 0, u32 first_index = 0);
+  static constexpr VkDeviceSize SCRATCH_BUDGET = 256ull << 20;
+
+  // builds are issued in batches, one vkCmdBuildAccelerationStructuresKHR each, so the driver can overlap them.
+  // with ALLOW_COMPACTION in build_flags every blas is copied into a right sized allocation afterwards
+  static void build_blas(Blas* blases, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags=VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR, VkDeviceSize scratch_budget=SCRATCH_BUDGET);
+
+private:
+  static void compact_blas(Blas* blases, u32 count, VkQueryPool compacted_sizes);
 };
 
 struct Instance {
@@ -30,16 +39,33 @@ struct Instance {
   VkGeometryInstanceFlagsKHR flags {VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR};
   glm::mat4 transform{glm::mat4(1)};
 
-  VkAccelerationStructureInstanceKHR toVkGeometryInstanceKHR(Blas *blas, u32 instance_id) const;
+  VkAccelerationStructureInstanceKHR toVkGeometryInstanceKHR(VkDeviceAddress blas_addr, u32 instance_id) const;
 };
 
 struct Tlas {
   AccelStructure accel_structure;
-  AllocatedBuffer instance_buffer;
+  AllocatedBuffer instance_buffer; // NUM_FRAMES slices of instances, persistently mapped
+  AllocatedBuffer scratch_buffer;
   VkWriteDescriptorSetAccelerationStructureKHR desc_info;
   std::vector<Instance> instances;
 
   void add_instance(u32 vert_id, u32 hit_group_id, glm::mat4& transform);
-  void build_tlas(Blas *blas, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags=VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+  void build_tlas(Blas *blas, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags=VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
   VkWriteDescriptorSetAccelerationStructureKHR* get_desc_info();
+
+  void set_transform(u32 instance_id, const glm::mat4& transform); // takes effect on the next update()
+  bool needs_update() const { return dirty; }
+  bool update(VkCommandBuffer cmd); // refits in place inside the frame's command buffer, true if anything moved
+
+private:
+  void write_instances(u32 slice);
+  VkAccelerationStructureBuildGeometryInfoKHR build_geometry_info(VkBuildAccelerationStructureModeKHR mode, u32 slice);
+  void record_build(VkCommandBuffer cmd, VkBuildAccelerationStructureModeKHR mode, u32 slice);
+
+  VkBuildAccelerationStructureFlagsKHR flags {0};
+  VkAccelerationStructureGeometryKHR geometry;
+  VkAccelerationStructureInstanceKHR* instance_data { nullptr };
+  VkDeviceAddress instance_addr {0}, scratch_addr {0};
+  std::vector<VkDeviceAddress> blas_addrs;
+  bool dirty { false };
 };
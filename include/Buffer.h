@@ -37,6 +37,8 @@ struct SceneGeometry {
   glm::mat4 transformIT;
   u32 vert_id;
   u32 mat_id;
+  u32 vertex_offset{0}; // where vert_id's mesh starts in the scene's shared vertex and index buffers
+  u32 index_offset{0};
 
   SceneGeometry(glm::vec3 pos, u32 vert_id, u32 mat_id);
   SceneGeometry(glm::vec3 pos, glm::vec3 axis, float angle, u32 vert_id, u32 mat_id);
@@ -15,7 +15,7 @@ struct CameraData {
 
 struct Camera
 {
-  float m_Yaw = 0.0f, m_Pitch = 0.0f, prevX =  1920/2, prevY = 1080/2;
+  float m_Yaw = 0.0f, m_Pitch = 0.0f, prevX = 0.0f, prevY = 0.0f, m_Fov = 45.0f;
   glm::vec3 m_Pos, m_Up = glm::vec3(0.0f, 1.0f, 0.0f), m_Dir;
   bool first = true;
   const float rotSpeed = 0.015f;
@@ -26,10 +26,11 @@ struct Camera
   bool focused = true;
   void* data;
   
-  Camera(glm::vec3 initial_pos, glm::vec3 look_at, float fov);
+  Camera(glm::vec3 initial_pos, glm::vec3 look_at, float fov, glm::uvec2 resolution); // ubo is created by Scene::Build_Structures
  ~Camera() { ubo.unmap(); }
 
   void mouse_callback(GLFWwindow* window, double xpos, double ypos);
   void check_input(GLFWwindow* window, float dt);
   void update_ubo();
+  void set_resolution(glm::uvec2 resolution); // projection aspect follows the render resolution
 };
@@ -7,9 +7,22 @@ namespace vkcmd {
 };
 
 namespace vkutil {
+  struct UploadWait {
+    VkSemaphore semaphore;
+    u64 value;
+  };
+
   void init_utils();
   void immediate_submit(std::function<void(VkCommandBuffer)> execute_cmds); // blocks thread! use only for initilization
   void get_cmd_buffers(VkCommandBuffer* buffers, u32 count);
   VkFence submit_cmd_buffers(VkCommandBuffer *buffers, u32 count);
   void free_cmd_buffers(VkCommandBuffer *buffers, u32 count);
+
+  // records copies on the transfer queue and submits them without waiting. returns the value the upload
+  // timeline semaphore reaches once they finished. images should end in their final layout with a
+  // TRANSFER -> BOTTOM_OF_PIPE barrier, the transfer queue may not support any shader stages
+  u64 upload_async(std::function<void(VkCommandBuffer)> record_cmds);
+  void wait_upload(u64 value); // blocks until the upload finished
+  void gpu_wait_upload(u64 value); // the next graphics queue submit (immediate_submit or a frame) waits for the upload
+  bool take_upload_wait(UploadWait& wait); // for graphics queue submitters, false when nothing is pending
 }
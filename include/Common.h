@@ -7,6 +7,8 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int32_t i32;
+typedef int64_t i64;
 
 template <typename T, size_t Size>
 char (*count_of_helper(T (&_arr)[Size]))[Size];
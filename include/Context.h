@@ -14,6 +14,7 @@ struct SwapchainImage{
 
 struct Swapchain {
   u32 image_index;
+  VkExtent2D extent;
   VkRenderPass render_pass;
   VkSurfaceKHR surface {VK_NULL_HANDLE};
   VkSwapchainKHR swapchain {VK_NULL_HANDLE};
@@ -24,11 +25,15 @@ struct Swapchain {
 
 struct VkDeviceProps {
   u32 graphics_index;
+  u32 transfer_index; // same as graphics_index when the device has no transfer only family
+  u32 queue_families[2]; // graphics, transfer
   VkFormat image_format;
   VkFormat swapchain_format {VK_FORMAT_B8G8R8A8_SRGB};
   VkColorSpaceKHR swapchain_colorspace {VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
   VkPresentModeKHR present_mode {VK_PRESENT_MODE_FIFO_KHR};
   VkPhysicalDeviceRayTracingPipelinePropertiesKHR rt_properties;
+  VkPhysicalDeviceAccelerationStructurePropertiesKHR as_properties;
+  VkPhysicalDeviceIDProperties id_properties; // device and driver uuids, part of the blas cache key
 };
 
 struct FrameData {
@@ -47,9 +52,12 @@ struct VkContext {
   VkDevice device;
   VkQueue graphics_queue, present_queue, transfer_queue;
   VkCommandPool cmd_pool;
+  VkPipelineCache pipeline_cache{VK_NULL_HANDLE};
   VkDeviceProps device_props;
 
   u32 frame_index = 0;
+  u32 current_frame = 0; // frame_data slot being recorded, per frame host data in this slot is no longer read by the gpu
+  bool headless = false; // no surface/swapchain, frames are submitted without presenting
   Swapchain swapchain;
   FrameData frame_data[NUM_FRAMES];
   
@@ -57,13 +65,24 @@ struct VkContext {
   void EndFrame();
 };
 
+// shared settings only, every compile clones the options and runs its own shaderc::Compiler so stages can build in parallel
 struct Compiler {
-  shaderc::Compiler compiler;
   shaderc::CompileOptions options;
   FileFinder ffinder{};
 };
 
 extern VkContext vkcontext;
+
+// buffers and images are written on the transfer queue and read on the graphics queue. when those are
+// different families they are shared concurrently rather than handed over with ownership transfers
+template <typename CreateInfo>
+void share_with_transfer_queue(CreateInfo& create_info) {
+  const VkDeviceProps& props = vkcontext.device_props;
+  if (props.graphics_index == props.transfer_index) return;
+  create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+  create_info.queueFamilyIndexCount = 2;
+  create_info.pQueueFamilyIndices = props.queue_families;
+}
 extern VmaAllocator vkallocator;
 extern Compiler vkcompiler;
 
@@ -77,6 +96,8 @@ namespace VulkanContext {
   void init_desc_pools();
   void init_compiler();
   void init_imgui(GLFWwindow* window);
+  void init_sync();
 
   void InitContext(GLFWwindow* window);
+  void InitHeadless();
 };
@@ -24,6 +24,7 @@ struct DescSet {
 
   WriteDescSet make_write_array(VkDescriptorBufferInfo* buffer_info, u32 binding, u32 arr_element=0);
   WriteDescSet make_write_array(VkDescriptorImageInfo* image_info, u32 binding, u32 arr_element=0);
+  WriteDescSet make_write_frames(VkDescriptorBufferInfo* frame_infos, u32 binding); // frame_infos[NUM_FRAMES], one per frame's set
 
   static void update_writes(WriteDescSet* writes, u32 count);
   static void bind_sets(VkCommandBuffer cmd_buff, DescSet *sets, u32 count, VkPipelineLayout pl_layout, u32 starting_binding);
@@ -0,0 +1,39 @@
+#pragma once
+#include "Common.h"
+#include "Buffer.h"
+#include "Image.h"
+#include <future>
+#include <string>
+#include <vector>
+
+// equirectangular hdr environment light. the image is decoded and its sampling distribution built on the
+// thread pool while the scene loads: a conditional cdf per row and a marginal cdf over rows of
+// luminance * sin(theta), so directions are drawn in proportion to the light they carry.
+// the buffer layout is mirrored in shaders/environment.glsl
+struct EnvironmentMap {
+  AllocatedImage radiance; // rgba32f, half floats would clip suns above 65504 that the cdfs still count. a black texel without an environment
+  AllocatedBuffer distribution; // Header, then marginal cdf [height+1], conditional cdfs [height][width+1], weights [height][width]
+
+  ~EnvironmentMap();
+
+  void start(const std::string& file, float multiplier); // an empty file keeps the sky gradient
+  u64 upload(); // waits for the decode, returns the upload to wait on
+
+private:
+  struct Header { // matches the glsl buffer
+    u32 width; // 0 without an environment
+    u32 height;
+    float integral; // mean weight, 0 for a black map
+    float multiplier;
+  };
+
+  bool decode();
+
+  std::string file;
+  float multiplier{1.0f};
+  u32 width{0}, height{0};
+  float integral{0};
+  std::vector<float> pixels; // rgba32f
+  std::vector<float> tables;
+  std::future<bool> decoding;
+};
@@ -10,15 +10,23 @@ struct AllocatedImage {
   VkSampler sampler { VK_NULL_HANDLE };
   VmaAllocation allocation { VK_NULL_HANDLE };
   VkDescriptorImageInfo desc_info;
+  VkFormat format { VK_FORMAT_R8G8B8A8_UNORM };
+  VkExtent3D extent {};
+  u32 mip_levels { 1 };
 
-  void create(VkImageUsageFlags image_usage, VkExtent3D extent, u32 mipmap_count=1);
+  void create(VkImageUsageFlags image_usage, VkExtent3D extent, u32 mipmap_count=1, VkFormat format=VK_FORMAT_R8G8B8A8_UNORM);
   VkDescriptorImageInfo* get_desc_info(VkImageLayout image_layout);
   static void fill_desc_infos(AllocatedImage* images, VkDescriptorImageInfo* image_infos, u32 count, VkImageLayout image_layout);
   void cmdTransitionLayout(VkCommandBuffer cmd_buff, VkImageLayout old_layout, VkImageLayout new_layout);
+  void cmdTransitionToShaderRead(VkCommandBuffer cmd_buff); // TRANSFER_DST -> SHADER_READ_ONLY, valid on a transfer only queue
   void cmdCopyImage(VkCommandBuffer cmd_buff, VkImage dst_image,VkImageLayout src_layout,VkImageLayout dst_layout, u32 copy_count, VkImageCopy* regions);
+  void cmdCopyToBuffer(VkCommandBuffer cmd_buff, VkBuffer dst_buffer, VkImageLayout src_layout);
 };
 
 namespace vkutil {  
   void TransImageLayout(VkImage image, VkCommandBuffer cmd_buff, VkImageLayout old_layout, VkImageLayout new_layout);
-  void toImage(VkCommandBuffer cmd, VkImage image, VkDeviceSize offset, VkDeviceSize size, const void *data, VkExtent3D image_extent);
+  void toImage(VkCommandBuffer cmd, VkImage image, VkDeviceSize size, const void *data, VkExtent3D image_extent);
+  void toImage(VkCommandBuffer cmd, VkImage image, const void *data, VkExtent3D image_extent, u32 mip_count, VkFormat format); // tightly packed mip chain, one staging copy
+  VkDeviceSize mip_level_size(VkFormat format, u32 width, u32 height, u32 level); // rgba8, bc5 and bc7 only
+
 };
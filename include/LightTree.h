@@ -0,0 +1,25 @@
+#pragma once
+#include "Common.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+struct Light;
+
+struct LightNode { // matches the glsl struct in shaders/light_tree.glsl
+  glm::vec3 bounds_min;
+  float power; // luminance of emission * area, summed over the subtree
+  glm::vec3 bounds_max;
+  float cos_theta_o; // every emitter normal is within theta_o of axis
+  glm::vec3 axis;
+  float cos_theta_e; // and emits within theta_e of its normal
+  u32 child; // interior: index of the second child, the first one is the next node. leaf: light index
+  u32 leaf;
+};
+
+// binary bvh over the scene's lights, one light per leaf and nodes in depth first order. every node bounds
+// the position, power and emission directions of its lights, so the shader can walk it both to pick a light
+// by its importance to a shading point and to intersect rays with the lights. never empty, without lights
+// the root is a leaf with zero power
+namespace LightTree {
+  std::vector<LightNode> build(const std::vector<Light>& lights);
+};
@@ -0,0 +1,25 @@
+#pragma once
+#include "Common.h"
+#include <string>
+
+// read-only memory mapping of a whole file, move-only
+struct MappedFile {
+  const u8* data { nullptr };
+  size_t size { 0 };
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+ ~MappedFile() { close(); }
+
+  bool open(const std::string& filename);
+  void close();
+
+private:
+#ifdef _WIN32
+  void* file_handle { nullptr };
+  void* mapping_handle { nullptr };
+#endif
+};
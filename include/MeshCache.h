@@ -0,0 +1,15 @@
+#pragma once
+#include "Common.h"
+#include <string>
+
+struct GeometryData;
+
+// binary .pmesh cache of welded obj meshes. an entry is keyed on the absolute obj path and its
+// size and mtime, and is mapped straight into GeometryData on a hit
+namespace MeshCache {
+  constexpr u32 VERSION = 1; // bump whenever Vert or the file layout changes
+  inline std::string cache_dir; // empty = write the .pmesh next to the obj
+
+  bool load(const std::string& obj_file, GeometryData& geometry);
+  bool store(const std::string& obj_file, const GeometryData& geometry);
+};
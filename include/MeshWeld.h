@@ -0,0 +1,10 @@
+#pragma once
+#include "Common.h"
+#include <tiny_obj_loader.h>
+#include <vector>
+
+struct Vert;
+
+// dedups face corners by their obj (vertex, normal, texcoord) index triple and appends the welded
+// vertices and the triangle indices. shapes must be triangulated, as LoadObj does by default
+void weld_vertices(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes, std::vector<Vert>& vertices, std::vector<u32>& indices);
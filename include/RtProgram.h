@@ -4,7 +4,10 @@
 #include "Image.h"
 #include "Descriptors.h"
 #include "Context.h"
+#include "ShaderWatcher.h"
 #include <unordered_set>
+#include <span>
+#include <future>
 
 struct RtConfig {
   int sample_count;
@@ -13,6 +16,7 @@ struct RtConfig {
   float exposure;
   u32 num_lights;
   u32 frame_count;
+  glm::uvec2 tile_offset; // pushed by RtProgram::trace for every tile
   bool show_lights;
 };
 
@@ -28,7 +32,26 @@ struct RtShader {
   VkStridedDeviceAddressRegionKHR sbt_call{};
 };
 
+// pipeline, sbt and modules built by a background rebuild, swapped in by RtProgram::poll_reload
+struct PipelineRebuild {
+  bool success = false;
+  std::vector<VkPipelineShaderStageCreateInfo> stages;
+  std::vector<u32> replaced; // stage ids that got new modules
+  std::vector<std::vector<std::string>> dependencies; // include closure of each replaced stage
+  VkPipeline pipeline{VK_NULL_HANDLE};
+  AllocatedBuffer sbt_buffer;
+  RtShader rt_shaders;
+};
+
+struct RetiredPipeline {
+  VkPipeline pipeline;
+  AllocatedBuffer sbt_buffer;
+  u32 frames_left;
+};
+
 struct RtProgram {
+  static constexpr u32 STAGE_COUNT = 3; // rgen, rmiss, rchit
+
   VkPipeline pipeline{VK_NULL_HANDLE};
   VkPipelineLayout pl_layout{VK_NULL_HANDLE};
   AllocatedBuffer sbt_buffer;
@@ -36,9 +59,25 @@ struct RtProgram {
   std::vector<VkRayTracingShaderGroupCreateInfoKHR> shader_groups;
   std::vector<VkPipelineShaderStageCreateInfo> shader_stages;
 
+  std::string stage_files[STAGE_COUNT];
+  std::vector<std::string> stage_dependencies[STAGE_COUNT];
+  ShaderWatcher watcher;
+  std::future<PipelineRebuild> rebuild;
+  u32 queued_stages = 0; // requested while a rebuild was already running
+  std::vector<RetiredPipeline> retired;
+
   void init_shader_groups(const char* rgen, const char* rmiss, const char* rchit, DescSet* sets, u32 count);
   void create_sbt();
   void bind(VkCommandBuffer cmd_buff);
-  void render_to_swapchain(const FrameData& frame_data, AllocatedImage& output_image);
+  void trace(VkCommandBuffer cmd_buff, std::span<const VkRect2D> tiles);
+  void render_to_swapchain(const FrameData& frame_data, AllocatedImage& output_image, std::span<const VkRect2D> tiles);
+
+  // splits the image into row major tiles, a 0 tile dimension covers the whole image along that axis
+  static std::vector<VkRect2D> make_tiles(VkExtent3D extent, glm::uvec2 tile_size);
+  // starts a background rebuild of the given stages, never blocks the render thread
   void update_shaders(const char* rgen=nullptr, const char* rmiss=nullptr, const char* rchit=nullptr);
+  // call between frames: picks up shader file changes and swaps in a finished rebuild. true if the pipeline changed
+  bool poll_reload();
+  void start_rebuild(u32 stage_mask);
+  void watch_stage_files();
 };
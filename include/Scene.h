@@ -1,12 +1,16 @@
 #pragma once
 #include "Context.h"
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include "Camera.h"
 #include "Blas.h"
 #include "Image.h"
 #include "Descriptors.h"
-#define GLM_ENABLE_EXPERIMENTAL
-#include <glm/gtx/hash.hpp>
+#include "MappedFile.h"
+#include "TextureLoader.h"
+#include "VirtualTexture.h"
+#include "EnvironmentMap.h"
+#include <span>
 
 struct Vert {
   glm::vec3 pos;
@@ -18,16 +22,6 @@ struct Vert {
   }
 };
 
-namespace std {
-    template<> struct hash<Vert> {
-        size_t operator()(Vert const& vertex) const {
-            return ((hash<glm::vec3>()(vertex.pos) ^
-                   (hash<glm::vec3>()(vertex.normal) << 1)) >> 1) ^
-                   (hash<glm::vec2>()(vertex.uv) << 1);
-        }
-    };
-}
-
 struct Material {
   glm::vec4 albedo{1,1,1,0}; // w = materialType
   glm::vec3 emission{0,0,0};
@@ -40,8 +34,13 @@ struct Material {
 };
 
 struct GeometryData {
-  std::vector<Vert> vertices;
+  std::vector<Vert> vertices; // welded obj data, left empty when the mesh came from the cache
   std::vector<u32> indices;
+  MappedFile cache_file;
+  std::span<const Vert> vertex_view; // points into vertices/indices or the mapped .pmesh
+  std::span<const u32> index_view;
+  u32 vertex_offset{0}; // first vertex and index in SceneBuffers::vertex_buffer/index_buffer
+  u32 index_offset{0};
 
   void load_obj(const std::string& filename); // only supports wavefront .obj files for now
 };
@@ -54,36 +53,88 @@ struct Light {
   glm::vec3 radius_area_type;
 };
 
+// one entry of the light selection alias table, built from emission * area by Build_Structures
+struct LightAlias {
+  float probability; // chance of keeping this entry's light, otherwise alias is picked
+  u32 alias;
+  float pmf; // chance of picking this entry's light overall
+};
+
+struct RenderSettings {
+  glm::uvec2 resolution{1920, 1080};
+  u32 max_depth{5};
+  glm::uvec2 tile_size{0, 0}; // 0 = whole image
+  std::string env_map;
+  float hdr_multiplier{1.0f};
+  bool compact_blas{false}; // slower startup, acceleration structures typically shrink by half
+};
+
+struct Keyframe {
+  float time; // seconds
+  glm::vec3 position{0, 0, 0};
+  glm::quat rotation{1, 0, 0, 0};
+  glm::vec3 scale{1, 1, 1};
+};
+
+// keyframes sorted by time, positions and scales are interpolated linearly and rotations with slerp
+struct InstanceAnimation {
+  u32 instance_id;
+  std::vector<Keyframe> keyframes;
+  bool loop{true};
+};
+
 struct SceneBuffers {
-  std::vector<AllocatedBuffer> vbos;
-  std::vector<AllocatedBuffer> ibos;
-  std::vector<AllocatedImage> textures;
-  AllocatedBuffer scene_buffer;
+  AllocatedBuffer vertex_buffer; // every mesh packed back to back, see GeometryData::vertex_offset
+  AllocatedBuffer index_buffer;
+  AllocatedBuffer scene_buffer; // NUM_FRAMES slices of SceneGeometry, persistently mapped
+  VkDeviceSize scene_slice_size{0};
+  u8* scene_data{nullptr};
   AllocatedBuffer mat_buffer;
   AllocatedBuffer light_buffer;
+  AllocatedBuffer light_alias_buffer; // LightAlias per light
+  AllocatedBuffer light_tree_buffer; // LightNodes, see LightTree
 };
 
 struct Scene {
   Tlas tlas;
   std::vector<Blas> blases;
   SceneBuffers scene_buffers;
+  VirtualTextures virtual_textures;
+  EnvironmentMap environment; // started by Load_Scene from settings.env_map
   DescSet scene_set;
   
   std::vector<Light> lights;
   std::vector<SceneGeometry> scene_geometry;
+  std::vector<InstanceAnimation> animations;
   std::vector<GeometryData> geometries;
+  std::vector<std::string> mesh_files;
   std::vector<std::string> textures;
+  std::vector<TextureKind> texture_kinds;
   std::vector<Material> materials;
+  RenderSettings settings;
 
   std::unordered_map<std::string, u32> loaded_geometries;
   std::unordered_map<std::string, u32> loaded_textures;
   std::unordered_map<std::string, u32> loaded_materials;
   
   u32 add_mesh(const std::string &filename);
-  u32 add_texture(const std::string &filename);
+  u32 add_texture(const std::string &filename, TextureKind kind);
   u32 add_material(const Material& mat, const std::string &filename);
+  void load_meshes();
 
   bool Load_Scene(std::string& filename);
   bool Build_Structures();
+  void bake_textures(); // only fills the texture cache, instead of Build_Structures
+
+  // instances can move after Build_Structures. a new transform reaches the shaders and the tlas
+  // through update_instances(), which the frame loop calls once per recorded frame
+  void set_transform(u32 instance_id, const glm::mat4& transform);
+  void add_animation(const InstanceAnimation& animation);
+  void animate(float time); // evaluates every animation at time and sets the transforms
+  bool update_instances(VkCommandBuffer cmd); // writes this frame's SceneGeometry slice and refits the tlas, true if anything moved
   Camera* camera;
+
+private:
+  TextureLoader texture_loader; // started by Load_Scene, drained by Build_Structures
+  u32 stale_slices{0}; // bit per frame slot whose SceneGeometry slice predates the last transform change
 };
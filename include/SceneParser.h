@@ -0,0 +1,37 @@
+#pragma once
+#include "Common.h"
+#include <string_view>
+#include <glm/glm.hpp>
+
+// hash used to switch on scene keys, duplicate case labels catch collisions between known keys at compile time
+constexpr u64 key_hash(std::string_view key) {
+  u64 hash = 0xcbf29ce484222325ull;
+  for (char c : key) {
+    hash ^= (u8) c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// single pass line based tokenizer over an in memory (mapped) scene file.
+// words are split on whitespace, '{' and '}' are always words of their own and '#' comments out the rest of a line
+struct SceneTokenizer {
+  const char* cursor;
+  const char* end;
+  u32 line { 0 }; // 1-based number of the current line, 0 before the first next_line()
+
+  SceneTokenizer(const char* begin, const char* end);
+
+  bool next_line();           // moves to the next line that has a word on it, false at the end of the file
+  std::string_view word();    // next word on the current line, empty once the line is used up
+  std::string_view rest();    // remainder of the current line with surrounding whitespace trimmed
+  bool at_line_end();         // true if the current line has no words left
+
+  bool read(float& value);
+  bool read(u32& value);
+  bool read(glm::vec3& value);
+
+private:
+  void skip_space();
+  void skip_line();
+};
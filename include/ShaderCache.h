@@ -0,0 +1,19 @@
+#pragma once
+#include "Common.h"
+#include <vulkan/shaderc.hpp>
+#include <string>
+#include <vector>
+
+// on disk cache of compiled spir-v and the driver's VkPipelineCache. a spir-v entry is keyed on a hash
+// of the shader source and every file it included, so editing a .glsl header invalidates its users
+namespace ShaderCache {
+  constexpr u32 VERSION = 1; // bump whenever the compile options or the file layout change
+  inline std::string cache_dir = "shader_cache";
+
+  // compiles glsl to spir-v, or reuses the cached binary when nothing in the include closure changed. thread safe.
+  // dependencies receives the include closure
+  bool compile(const char* file, shaderc_shader_kind shader_kind, std::vector<u32>& spirv, std::vector<std::string>* dependencies = nullptr);
+
+  void load_pipeline_cache(); // creates vkcontext.pipeline_cache, seeded from disk if the data matches this device
+  void save_pipeline_cache();
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include "Common.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+
+// reports writes to a set of files (shader stages and their includes). the parent directories are watched
+// with inotify rather than the files, since most editors save by renaming a temp file over the original.
+// other platforms fall back to polling the modification times a few times a second
+struct ShaderWatcher {
+  ShaderWatcher() = default;
+  ShaderWatcher(const ShaderWatcher&) = delete;
+  ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+ ~ShaderWatcher();
+
+  void watch(const std::vector<std::string>& files); // replaces the watched set
+  bool poll(); // non blocking, true if any watched file changed since the last call
+
+private:
+  std::unordered_set<std::string> files; // absolute, normalized
+#ifdef __linux__
+  int fd { -1 };
+  std::unordered_map<int, std::string> dirs; // watch descriptor -> directory
+#else
+  std::unordered_map<std::string, std::filesystem::file_time_type> mtimes;
+  std::chrono::steady_clock::time_point last_poll;
+#endif
+};
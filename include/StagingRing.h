@@ -0,0 +1,51 @@
+#pragma once
+#include "Common.h"
+#include "Buffer.h"
+#include <deque>
+#include <mutex>
+#include <vector>
+
+struct StagingAlloc {
+  VkBuffer buffer;
+  VkDeviceSize offset;
+  void* mapped;
+};
+
+// one persistently mapped upload buffer shared by every staging copy. space is handed out front to back,
+// everything allocated between two submits forms a batch that is reclaimed once that submit's fence signals.
+// allocations are attributed to the next close_batch(), so only one thread should record uploads at a time
+struct StagingRing {
+  static constexpr VkDeviceSize DEFAULT_CAPACITY = 64ull << 20;
+
+  void init(VkDeviceSize capacity = DEFAULT_CAPACITY);
+
+  // copies data into the ring. when the ring is full the oldest batches are waited on, and an upload
+  // that still does not fit (larger than the ring, or the ring is full of unsubmitted data) gets a dedicated buffer
+  StagingAlloc stage(const void* data, VkDeviceSize size, VkDeviceSize alignment = 16);
+  StagingAlloc allocate(VkDeviceSize size, VkDeviceSize alignment = 16); // same as stage, the caller fills in mapped
+
+  VkFence close_batch(); // fence for the submit that consumes everything staged so far, owned by the ring
+  void wait(VkFence fence); // blocks on a fence from close_batch() and reclaims every finished batch
+  void reclaim(); // non blocking
+
+private:
+  struct Batch {
+    VkDeviceSize end;
+    VkFence fence;
+    std::vector<AllocatedBuffer> dedicated;
+  };
+
+  void retire_front();
+  VkFence get_fence();
+
+  AllocatedBuffer buffer;
+  u8* mapped { nullptr };
+  VkDeviceSize capacity { 0 };
+  VkDeviceSize head { 0 }, tail { 0 }; // running byte counts, the position in the buffer is modulo capacity
+  std::vector<AllocatedBuffer> open_dedicated;
+  std::deque<Batch> in_flight;
+  std::vector<VkFence> free_fences;
+  std::mutex mutex;
+};
+
+extern StagingRing vkstaging;
@@ -0,0 +1,25 @@
+#pragma once
+#include "Common.h"
+#include "VkInclude.h"
+#include <string>
+#include <vector>
+
+struct MappedFile;
+
+enum class TextureKind { color, two_channel }; // bc7 for albedo, bc5 for maps that only use red and green
+
+// .ptex cache of block compressed textures with their whole mip chain, laid out like a ktx2 file: a header, then
+// every level tightly packed from the largest down. an entry is keyed on the source path, size and mtime
+namespace TextureCache {
+  constexpr u32 VERSION = 1; // bump whenever the encoder or the file layout changes
+  inline std::string cache_dir; // empty = write the .ptex next to the source image
+
+  VkFormat format_for(TextureKind kind);
+
+  // maps the cached chain, data points into file and stays valid while it is open
+  bool load(const std::string& image_file, TextureKind kind, MappedFile& file, const u8*& data, u32& width, u32& height, u32& mip_count);
+
+  // compresses an rgba8 mip chain (packed as TextureLoader produces it) into compressed and writes the cache entry
+  void encode(TextureKind kind, const u8* rgba_chain, u32 width, u32 height, u32 mip_count, std::vector<u8>& compressed);
+  bool store(const std::string& image_file, TextureKind kind, const std::vector<u8>& compressed, u32 width, u32 height, u32 mip_count);
+};
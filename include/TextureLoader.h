@@ -0,0 +1,46 @@
+#pragma once
+#include "Common.h"
+#include "VkInclude.h"
+#include "MappedFile.h"
+#include "TextureCache.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct DecodedTexture {
+  u32 id; // index into the file list given to start()
+  u32 width, height;
+  u32 mip_count;
+  VkFormat format;
+  const u8* pixels; // mip chain in format, the levels are packed back to back starting with the full resolution one
+  bool placeholder; // the file could not be decoded, pixels is a single magenta rgba8 texel
+  std::vector<u8> storage; // owns pixels after a decode
+  MappedFile cache_file; // owns pixels when they came from the texture cache
+};
+
+// decodes textures on the thread pool in the background. at most capacity textures are decoded or waiting
+// to be uploaded at any time, a new decode is only queued once the upload stage releases one.
+// with compress set textures are block compressed, straight from the texture cache when it has them
+struct TextureLoader {
+  ~TextureLoader();
+
+  void start(const std::vector<std::string>& files, const std::vector<TextureKind>& kinds, u32 capacity, bool compress);
+  bool next(DecodedTexture& texture); // blocks for the next decoded texture in completion order, false once all were handed out
+  void release(DecodedTexture& texture); // frees the pixels and lets another decode start
+
+private:
+  void queue_decode(); // expects mutex to be held
+  void decode(u32 id);
+
+  std::vector<std::string> files;
+  std::vector<TextureKind> kinds;
+  bool compress{false};
+  u32 next_file{0};
+  u32 handed_out{0};
+  u32 decoding{0};
+  std::deque<DecodedTexture> ready;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
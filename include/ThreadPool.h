@@ -0,0 +1,39 @@
+#pragma once
+#include "Common.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <queue>
+#include <vector>
+
+struct ThreadPool {
+  ThreadPool(u32 thread_count = 0); // 0 = hardware_concurrency()-1
+ ~ThreadPool();
+
+  template <typename F>
+  auto submit(F&& job) -> std::future<decltype(job())> {
+    auto task = std::make_shared<std::packaged_task<decltype(job())()>>(std::forward<F>(job));
+    auto result = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return result;
+  }
+
+  // runs job(0..count-1) on the workers and the calling thread, returns once every index is done.
+  // the caller takes part in the work, so it is safe to call from inside another job
+  void parallel_for(u32 count, const std::function<void(u32)>& job);
+  u32 size() const { return (u32) workers.size(); }
+
+private:
+  void enqueue(std::function<void()> job);
+  void worker_loop();
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+};
+
+extern ThreadPool thread_pool;
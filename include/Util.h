@@ -0,0 +1,34 @@
+#pragma once
+#include "Common.h"
+#include <string.h>
+
+// small helpers shared by the caches and the acceleration structure code
+namespace util {
+  constexpr u64 FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+  constexpr u64 FNV_PRIME = 0x100000001b3ull;
+
+  // fnv-1a, same as key_hash in the scene parser
+  inline u64 hash_bytes(u64 hash, const void* data, size_t size) {
+    const u8* bytes = (const u8*) data;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * FNV_PRIME;
+    return hash;
+  }
+
+  // eight bytes per step for large inputs such as mesh data, the tail goes through fnv-1a
+  inline u64 hash_words(u64 hash, const void* data, size_t size) {
+    const u8* bytes = (const u8*) data;
+    size_t i = 0;
+    for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+      u64 word;
+      memcpy(&word, bytes + i, sizeof(word));
+      hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+      hash ^= hash >> 32;
+    }
+    return hash_bytes(hash, bytes + i, size - i);
+  }
+
+  // alignment does not have to be a power of two
+  constexpr u64 align_up(u64 value, u64 alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+};
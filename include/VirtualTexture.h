@@ -0,0 +1,102 @@
+#pragma once
+#include "Common.h"
+#include "RenderCommon.h"
+#include "Buffer.h"
+#include "Image.h"
+#include "TextureLoader.h"
+#include <mutex>
+#include <vector>
+
+// page based virtual texturing. every mip level of a texture is cut into pages that are streamed into one of two
+// physical atlases (bc7 and bc5) on demand. the raygen shader reports the pages it wanted through a per frame
+// feedback buffer, worker threads cut those pages out of the texture cache and update() copies them into the
+// atlas and the page table. the largest level that fits a single page is pinned, so a lookup always finds something.
+// the layout constants are mirrored in shaders/virtual_texture.glsl
+struct VirtualTextures {
+  static constexpr u32 PAGE_SIZE = 128; // texels per side including the border
+  static constexpr u32 PAGE_BORDER = 4; // one bc block on every side, wrapped neighbours for bilinear filtering
+  static constexpr u32 PAGE_INTERIOR = PAGE_SIZE - 2*PAGE_BORDER;
+  static constexpr u32 PAGE_BYTES = (PAGE_SIZE/4) * (PAGE_SIZE/4) * 16;
+  static constexpr u32 ATLAS_PAGES = 64; // per side, 8192x8192 texels. an atlas no texture uses is a single page
+  static constexpr u32 MAX_UPLOADS = 64; // pages copied into the atlases per frame
+  static constexpr u32 FEEDBACK_CAPACITY = 1 << 16; // distinct pages one frame can report
+
+  AllocatedImage atlases[2]; // bc7, bc5. kept in GENERAL so per frame copies need no layout transitions
+  AllocatedBuffer page_table; // u32 per page: 0 = not resident, else resident bit | atlas slot y << 8 | atlas slot x
+  AllocatedBuffer texture_info; // VtTexture per texture
+  AllocatedBuffer feedback; // NUM_FRAMES slices of { count, page ids[FEEDBACK_CAPACITY], requested bit per page }
+
+  // in any order, every id must be added before init(). takes over the texture's mapped cache entry, pages are
+  // cut from it while streaming. the texture is left to be released to the loader
+  void add_texture(DecodedTexture& texture);
+  u64 init(); // creates the atlases and tables and uploads the pinned levels, returns the upload to wait on
+
+  bool poll(); // takes pages the workers finished, true if any of them replaces a coarser level for the first time
+  void update(VkCommandBuffer cmd); // reads this frame's feedback, queues page loads and uploads polled pages
+  void end_frame(VkCommandBuffer cmd); // after the trace, makes the feedback it wrote visible to the host
+  bool streaming(); // pages are still being loaded or waiting for upload
+
+  void fill_desc_infos(VkDescriptorImageInfo atlas_infos[2], VkDescriptorBufferInfo feedback_infos[NUM_FRAMES]);
+
+private:
+  struct VtTexture { // matches the glsl struct
+    u32 width;
+    u32 height;
+    u32 level_count; // levels down to and including the pinned one
+    u32 atlas;
+    u32 first_page;
+  };
+  struct Slot {
+    u32 page { UINT32_MAX };
+    u64 last_used { 0 };
+    bool pinned { false };
+  };
+  struct TextureSource {
+    u32 width, height;
+    u32 mip_count;
+    VkFormat format; // bc7 or bc5
+    const u8* data; // mip chain, points into file, storage or the placeholder block
+    MappedFile file; // the .ptex entry
+    std::vector<u8> storage; // only when the texture cache could not be written
+  };
+  struct LoadedPage {
+    u32 page;
+    bool first_load;
+    std::vector<u8> data;
+  };
+
+  static u32 atlas_for(VkFormat format);
+  void locate(u32 page, u32& texture, u32& level, u32& x, u32& y) const;
+  void build_page(u32 texture, u32 level, u32 x, u32 y, u8* out) const;
+  u32 atlas_of(u32 page) const;
+  bool evictable(const Slot& slot) const;
+  u32 take_slot(u32 atlas); // free or least recently used slot, UINT32_MAX when every slot is in use
+  u32 pages_in_level(u32 texture, u32 level, u32* pages_x = nullptr) const;
+  u32 page_count_before_level(u32 texture, u32 level) const;
+  static constexpr VkDeviceSize staging_slice_size() { return MAX_UPLOADS*PAGE_BYTES + 2*MAX_UPLOADS*sizeof(u32); }
+
+  std::vector<TextureSource> textures;
+  std::vector<VtTexture> infos;
+  std::vector<u32> entries; // cpu copy of page_table
+  std::vector<u32> page_slots; // atlas slot of every resident page
+  std::vector<u8> loading; // page is queued on a worker or waiting for upload
+  std::vector<u8> was_resident; // page has been in the atlas before, reloading it does not restart accumulation
+  std::vector<Slot> slots[2];
+  u32 atlas_pages[2] { 1, 1 }; // per side
+  std::vector<u32> free_slots[2];
+  u32 pending[2] { 0, 0 }; // page loads per atlas that will take a slot once uploaded
+  bool atlas_full_warned { false };
+  u32 page_count { 0 };
+  u64 frame { 0 };
+
+  AllocatedBuffer staging; // NUM_FRAMES slices of MAX_UPLOADS pages and their page table entries
+  u8* staging_data { nullptr };
+  u8* feedback_data { nullptr };
+  VkDeviceSize feedback_slice_size { 0 };
+  VkDeviceSize feedback_bits_size { 0 };
+
+  u32 in_flight { 0 }; // page loads queued or running on the workers
+  std::vector<LoadedPage> polled; // owned by the main thread, uploaded by the next update()
+  std::vector<LoadedPage> finished; // filled by the workers
+  std::mutex mutex;
+};
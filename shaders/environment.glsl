@@ -0,0 +1,70 @@
+// equirectangular environment light, the layout matches include/EnvironmentMap.h
+layout(binding = 9, set = 1) uniform sampler2D env_map;
+layout(binding = 10, set = 1, scalar) readonly buffer EnvDistribution {
+  uint width; // 0 without an environment map
+  uint height;
+  float integral; // mean weight, 0 for a black map
+  float multiplier;
+  float data[]; // marginal cdf [height+1], conditional cdfs [height][width+1], weights [height][width]
+} env;
+
+vec2 env_uv(vec3 dir) {
+  float phi = atan(dir.z, dir.x);
+  float theta = acos(clamp(dir.y, -1.0, 1.0));
+  return vec2(phi / (2*PI) + 0.5, theta / PI);
+}
+
+vec3 env_dir(vec2 uv) {
+  float phi = (uv.x - 0.5) * 2*PI;
+  float theta = uv.y * PI;
+  return vec3(sin(theta)*cos(phi), cos(theta), sin(theta)*sin(phi));
+}
+
+vec3 env_radiance(vec3 dir) {
+  return textureLod(env_map, env_uv(dir), 0).rgb * env.multiplier;
+}
+
+// solid angle pdf of env_sample() returning the direction with these uv
+float env_pdf_uv(vec2 uv) {
+  float sin_theta = sin(uv.y * PI);
+  if(env.integral <= 0 || sin_theta <= 0) return 0;
+  uint col = min(uint(uv.x * env.width), env.width - 1);
+  uint row = min(uint(uv.y * env.height), env.height - 1);
+  float weight = env.data[env.height + 1 + env.height*(env.width + 1) + row*env.width + col];
+  return weight / (env.integral * 2*PI*PI * sin_theta);
+}
+
+float env_pdf(vec3 dir) {
+  return env_pdf_uv(env_uv(dir));
+}
+
+// last i in [0, count) with cdf[offset + i] <= u
+uint env_find(uint offset, uint count, float u) {
+  uint lo = 0;
+  uint hi = count;
+  while(hi - lo > 1) {
+    uint mid = (lo + hi) / 2;
+    if(env.data[offset + mid] <= u) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// picks a direction in proportion to the environment's luminance, returns the radiance arriving from it
+vec3 env_sample(inout uint rng_state, out vec3 dir, out float pdf) {
+  uint w = env.width;
+  uint h = env.height;
+  float u = rand(rng_state);
+  float v = rand(rng_state);
+
+  uint row = env_find(0, h, v);
+  float dv = (v - env.data[row]) / max(env.data[row + 1] - env.data[row], 1e-12);
+  uint cdf = h + 1 + row*(w + 1);
+  uint col = env_find(cdf, w, u);
+  float du = (u - env.data[cdf + col]) / max(env.data[cdf + col + 1] - env.data[cdf + col], 1e-12);
+
+  vec2 uv = vec2((float(col) + clamp(du, 0.0, 1.0)) / float(w), (float(row) + clamp(dv, 0.0, 1.0)) / float(h));
+  dir = env_dir(uv);
+  pdf = env_pdf_uv(uv);
+  return textureLod(env_map, uv, 0).rgb * env.multiplier;
+}
@@ -0,0 +1,94 @@
+// light bvh, the layout matches include/LightTree.h
+struct LightNode {
+  vec3 bounds_min;
+  float power;
+  vec3 bounds_max;
+  float cos_theta_o;
+  vec3 axis;
+  float cos_theta_e;
+  uint child; // interior: second child, the first one is the next node. leaf: light index
+  uint leaf;
+};
+
+layout(binding = 12, set = 1, scalar) readonly buffer LightTree { LightNode n[]; } light_tree;
+
+#define LIGHT_STACK_SIZE 32
+
+// cos and sin of max(0, a - b), from the sines and cosines of a and b
+float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+  if(cos_a > cos_b) return 1;
+  return cos_a*cos_b + sin_a*sin_b;
+}
+
+float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+  if(cos_a > cos_b) return 0;
+  return sin_a*cos_b - cos_a*sin_b;
+}
+
+// upper bound on the light a node sends to p, for a surface with normal n. see "Importance Sampling of Many
+// Lights with Adaptive Tree Splitting" (Conty Estevez and Kulla 2018), this is the variant pbrt-v4 uses
+float light_importance(LightNode node, vec3 p, vec3 n) {
+  if(node.power <= 0) return 0;
+  vec3 diagonal = node.bounds_max - node.bounds_min;
+  vec3 to_p = p - 0.5*(node.bounds_min + node.bounds_max);
+  float dist2 = dot(to_p, to_p);
+  vec3 wi = dist2 > 0 ? to_p * inversesqrt(dist2) : n;
+
+  // the directions the box covers as seen from p
+  float radius2 = 0.25*dot(diagonal, diagonal);
+  float cos_b = dist2 < radius2 ? -1 : sqrt(max(1 - radius2/dist2, 0));
+  float sin_b = sqrt(max(1 - cos_b*cos_b, 0));
+
+  // smallest angle between an emitter normal and the direction to p
+  float cos_w = dot(node.axis, wi);
+  float sin_w = sqrt(max(1 - cos_w*cos_w, 0));
+  float sin_o = sqrt(max(1 - node.cos_theta_o*node.cos_theta_o, 0));
+  float cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, node.cos_theta_o);
+  float sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, node.cos_theta_o);
+  float cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+  if(cos_p <= node.cos_theta_e) return 0;
+
+  float cos_i = abs(dot(wi, n));
+  float sin_i = sqrt(max(1 - cos_i*cos_i, 0));
+  float cos_pi = cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+  return node.power * cos_p * max(cos_pi, 0) / max(dist2, 0.5*length(diagonal));
+}
+
+// walks down the tree choosing each child in proportion to its importance.
+// pmf is the chance of ending at the returned light, 0 when no light can reach p
+uint pick_light_tree(inout uint rng_state, vec3 p, vec3 n, out float pmf) {
+  float u = rand(rng_state);
+  uint node = 0;
+  pmf = 1;
+  while(light_tree.n[node].leaf == 0) {
+    uint first = node + 1;
+    uint second = light_tree.n[node].child;
+    float first_importance = light_importance(light_tree.n[first], p, n);
+    float second_importance = light_importance(light_tree.n[second], p, n);
+    if(first_importance + second_importance <= 0) {
+      pmf = 0;
+      return 0;
+    }
+
+    // u is rescaled into the chosen range, so one random number covers the whole descent
+    float p_first = first_importance / (first_importance + second_importance);
+    if(u < p_first) {
+      node = first;
+      u = min(u / p_first, 0.99999994);
+      pmf *= p_first;
+    } else {
+      node = second;
+      u = min((u - p_first) / (1 - p_first), 0.99999994);
+      pmf *= 1 - p_first;
+    }
+  }
+  return light_tree.n[node].child;
+}
+
+bool intersects_box(vec3 bounds_min, vec3 bounds_max, vec3 origin, vec3 inv_dir, float t_max) {
+  vec3 t0 = (bounds_min - origin) * inv_dir;
+  vec3 t1 = (bounds_max - origin) * inv_dir;
+  vec3 t_near = min(t0, t1);
+  vec3 t_far = max(t0, t1);
+  return max(max(t_near.x, t_near.y), max(t_near.z, 0)) <= min(min(t_far.x, t_far.y), min(t_far.z, t_max));
+}
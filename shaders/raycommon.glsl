@@ -21,11 +21,18 @@ struct Light {
   vec3 radius_area_type;
 };
 
+struct LightAlias {
+  float probability; // chance of keeping this entry's light, otherwise alias is picked
+  uint alias;
+  float pmf; // chance of picking this entry's light overall
+};
+
 struct hitPayload {
   vec3 normal;
   vec2 uv;
   uint mat_id;
   float t;
+  float uv_lod; // 0.5*log2(uv area / world area) of the hit triangle, the texture independent part of the mip level
 };
 
 vec3 less_than(vec3 f, float value) {
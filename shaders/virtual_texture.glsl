@@ -0,0 +1,73 @@
+// virtual texture lookups, the layout matches include/VirtualTexture.h
+#define VT_PAGE_SIZE 128u
+#define VT_PAGE_BORDER 4u
+#define VT_PAGE_INTERIOR 120u
+#define VT_FEEDBACK_CAPACITY 65536u
+
+struct VtTexture {
+  uint width;
+  uint height;
+  uint level_count;
+  uint atlas;
+  uint first_page;
+};
+
+layout(binding = 3, set = 1) uniform sampler2D vt_atlas[2]; // bc7, bc5
+layout(binding = 6, set = 1, scalar) readonly buffer PageTable { uint p[]; } page_table;
+layout(binding = 7, set = 1, scalar) readonly buffer VtTextures { VtTexture t[]; } vt_textures;
+layout(binding = 8, set = 1, scalar) buffer Feedback {
+  uint count;
+  uint pages[VT_FEEDBACK_CAPACITY];
+  uint requested[]; // bit per page, so each page is reported once per frame
+} feedback;
+
+uvec2 vt_level_size(VtTexture info, uint level) {
+  return max(uvec2(info.width, info.height) >> level, uvec2(1));
+}
+
+uvec2 vt_level_pages(VtTexture info, uint level) {
+  return (vt_level_size(info, level) + VT_PAGE_INTERIOR - 1u) / VT_PAGE_INTERIOR;
+}
+
+void vt_request(uint page) {
+  uint word = page >> 5;
+  uint bit = 1u << (page & 31u);
+  if((feedback.requested[word] & bit) != 0) return;
+  if((atomicOr(feedback.requested[word], bit) & bit) != 0) return;
+  uint slot = atomicAdd(feedback.count, 1u);
+  if(slot < VT_FEEDBACK_CAPACITY) feedback.pages[slot] = page;
+}
+
+// samples the level closest to lod, falling back to coarser levels until one is resident.
+// the wanted page is reported either way, and so is a coarser page that is sampled instead, so the
+// fallback stays resident (being reported is what keeps a page from being evicted)
+vec4 vt_sample(int tex_id, vec2 uv, float lod) {
+  VtTexture info = vt_textures.t[tex_id];
+  uint wanted = uint(clamp(lod + 0.5, 0.0, float(info.level_count - 1u)));
+  uv = fract(uv); // the pages carry wrapped borders, so this behaves like REPEAT
+
+  uint first = info.first_page;
+  for(uint level = 0; level < wanted; ++level) {
+    uvec2 pages = vt_level_pages(info, level);
+    first += pages.x * pages.y;
+  }
+
+  for(uint level = wanted; level < info.level_count; ++level) {
+    uvec2 pages = vt_level_pages(info, level);
+    vec2 texel = uv * vec2(vt_level_size(info, level));
+    uvec2 page = min(uvec2(texel) / VT_PAGE_INTERIOR, pages - 1u);
+    uint id = first + page.y * pages.x + page.x;
+    if(level == wanted) vt_request(id);
+
+    uint entry = page_table.p[id];
+    if(entry != 0) {
+      if(level != wanted) vt_request(id);
+      uvec2 slot = uvec2(entry & 0xFFu, (entry >> 8) & 0xFFu);
+      vec2 atlas_texel = vec2(slot * VT_PAGE_SIZE + VT_PAGE_BORDER) + texel - vec2(page * VT_PAGE_INTERIOR);
+      vec2 atlas_size = vec2(textureSize(vt_atlas[nonuniformEXT(info.atlas)], 0));
+      return textureLod(vt_atlas[nonuniformEXT(info.atlas)], atlas_texel / atlas_size, 0);
+    }
+    first += pages.x * pages.y;
+  }
+  return vec4(1, 0, 1, 1); // not reached, the last level is pinned
+}
@@ -0,0 +1,201 @@
+#include "AccelCache.h"
+#include "Scene.h"
+#include "CmdUtils.h"
+#include "ThreadPool.h"
+#include "Util.h"
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+struct AccelHeader {
+  char magic[4];
+  u32 version;
+  u64 key;
+  u64 blob_size;
+};
+
+static constexpr char ACCEL_MAGIC[4] = {'A', 'S', 'C', 'H'};
+
+// copies to and from acceleration structures need 256 byte aligned device addresses
+static constexpr VkDeviceSize BLOB_ALIGNMENT = 256;
+
+// the serialized blob starts with the driver and compatibility uuids, then the serialized and deserialized sizes
+static constexpr size_t BLOB_DESERIALIZED_SIZE_OFFSET = 2*VK_UUID_SIZE + sizeof(u64);
+static constexpr size_t BLOB_HEADER_SIZE = 2*VK_UUID_SIZE + 3*sizeof(u64);
+
+static std::string cache_path(u64 key) {
+  return (fs::path(AccelCache::cache_dir) / fmt::format("{:016x}.blas", key)).string();
+}
+
+u64 AccelCache::blas_key(const GeometryData& geometry, VkBuildAccelerationStructureFlagsKHR build_flags) {
+  u64 sizes[] = { VERSION, sizeof(Vert), build_flags, geometry.vertex_view.size(), geometry.index_view.size() };
+  u64 key = util::hash_words(util::FNV_OFFSET_BASIS, sizes, sizeof(sizes));
+  // each gpu in the machine gets its own entries instead of overwriting the other's
+  const VkPhysicalDeviceIDProperties& id = vkcontext.device_props.id_properties;
+  key = util::hash_words(key, id.deviceUUID, VK_UUID_SIZE);
+  key = util::hash_words(key, id.driverUUID, VK_UUID_SIZE);
+  key = util::hash_words(key, geometry.vertex_view.data(), geometry.vertex_view.size_bytes());
+  return util::hash_words(key, geometry.index_view.data(), geometry.index_view.size_bytes());
+}
+
+// maps an entry and checks it against the key and this device, blob points into the mapping
+static bool open_entry(u64 key, MappedFile& file, const u8*& blob, u64& blob_size) {
+  if (!file.open(cache_path(key)) || file.size < sizeof(AccelHeader)) return false;
+
+  AccelHeader header;
+  memcpy(&header, file.data, sizeof(header));
+  if (memcmp(header.magic, ACCEL_MAGIC, sizeof(ACCEL_MAGIC)) != 0 || header.version != AccelCache::VERSION || header.key != key) return false;
+  if (header.blob_size < BLOB_HEADER_SIZE || sizeof(AccelHeader) + header.blob_size != file.size) return false;
+  blob = file.data + sizeof(AccelHeader);
+  blob_size = header.blob_size;
+
+  VkAccelerationStructureVersionInfoKHR version_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR };
+  version_info.pVersionData = blob;
+  VkAccelerationStructureCompatibilityKHR compatibility;
+  vkGetDeviceAccelerationStructureCompatibilityKHR(vkcontext.device, &version_info, &compatibility);
+  if (compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR) {
+    info_log("Cached blas was serialized by a different device or driver, rebuilding {}", cache_path(key));
+    return false;
+  }
+  return true;
+}
+
+std::vector<u32> AccelCache::load(Blas* blases, const u64* keys, u32 count) {
+  struct Hit {
+    u32 index;
+    MappedFile file;
+    const u8* blob;
+    u64 blob_size;
+    VkDeviceSize offset;
+  };
+  std::vector<Hit> hits;
+  std::vector<u32> missing;
+  VkDeviceSize total_size {0};
+  for (u32 i = 0; i < count; ++i) {
+    Hit hit { i };
+    if (!open_entry(keys[i], hit.file, hit.blob, hit.blob_size)) {
+      missing.push_back(i);
+      continue;
+    }
+    hit.offset = total_size;
+    total_size = util::align_up(total_size + hit.blob_size, BLOB_ALIGNMENT);
+    hits.push_back(std::move(hit));
+  }
+  if (hits.empty()) return missing;
+
+  AllocatedBuffer blobs;
+  blobs.create(total_size + BLOB_ALIGNMENT, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
+  VkDeviceAddress blobs_addr = blobs.get_device_addr();
+  VkDeviceAddress base_addr = util::align_up(blobs_addr, BLOB_ALIGNMENT);
+
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    for (Hit& hit : hits) {
+      vkcmd::toBuffer(cmd, blobs.buffer, base_addr - blobs_addr + hit.offset, hit.blob_size, hit.blob);
+    }
+    VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    for (Hit& hit : hits) {
+      u64 deserialized_size;
+      memcpy(&deserialized_size, hit.blob + BLOB_DESERIALIZED_SIZE_OFFSET, sizeof(deserialized_size));
+      VkAccelerationStructureCreateInfoKHR as_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR };
+      as_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+      as_info.size = deserialized_size;
+      blases[hit.index].accel_structure.create(as_info);
+
+      VkCopyMemoryToAccelerationStructureInfoKHR copy_info = { VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR };
+      copy_info.src.deviceAddress = base_addr + hit.offset;
+      copy_info.dst = blases[hit.index].accel_structure.accel;
+      copy_info.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+      vkCmdCopyMemoryToAccelerationStructureKHR(cmd, &copy_info);
+    }
+  });
+  blobs.destroy();
+
+  info_log("Loaded {} of {} blases from the acceleration structure cache", hits.size(), count);
+  return missing;
+}
+
+void AccelCache::store(Blas* blases, const u64* keys, u32 count) {
+  if (!count) return;
+
+  VkQueryPool query_pool;
+  VkQueryPoolCreateInfo query_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+  query_info.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+  query_info.queryCount = count;
+  VK_CHECK(vkCreateQueryPool(vkcontext.device, &query_info, nullptr, &query_pool));
+
+  std::vector<VkAccelerationStructureKHR> accels(count);
+  for (u32 i = 0; i < count; ++i) accels[i] = blases[i].accel_structure.accel;
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    vkCmdResetQueryPool(cmd, query_pool, 0, count);
+    vkCmdWriteAccelerationStructuresPropertiesKHR(cmd, count, accels.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, query_pool, 0);
+  });
+  std::vector<VkDeviceSize> sizes(count);
+  VK_CHECK(vkGetQueryPoolResults(vkcontext.device, query_pool, 0, count, count*sizeof(VkDeviceSize), sizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+  vkDestroyQueryPool(vkcontext.device, query_pool, nullptr);
+
+  std::vector<VkDeviceSize> offsets(count);
+  VkDeviceSize total_size {0};
+  for (u32 i = 0; i < count; ++i) {
+    offsets[i] = total_size;
+    total_size = util::align_up(total_size + sizes[i], BLOB_ALIGNMENT);
+  }
+
+  AllocatedBuffer readback;
+  readback.create(total_size + BLOB_ALIGNMENT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+  VkDeviceAddress readback_addr = readback.get_device_addr();
+  VkDeviceAddress base_addr = util::align_up(readback_addr, BLOB_ALIGNMENT);
+
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    for (u32 i = 0; i < count; ++i) {
+      VkCopyAccelerationStructureToMemoryInfoKHR copy_info = { VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR };
+      copy_info.src = accels[i];
+      copy_info.dst.deviceAddress = base_addr + offsets[i];
+      copy_info.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+      vkCmdCopyAccelerationStructureToMemoryKHR(cmd, &copy_info);
+    }
+    VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+  });
+
+  const u8* data = (const u8*) readback.map() + (base_addr - readback_addr);
+  vmaInvalidateAllocation(vkallocator, readback.allocation, 0, VK_WHOLE_SIZE);
+
+  std::error_code ec;
+  fs::create_directories(cache_dir, ec);
+  thread_pool.parallel_for(count, [&](u32 i) {
+    AccelHeader header = {};
+    memcpy(header.magic, ACCEL_MAGIC, sizeof(ACCEL_MAGIC));
+    header.version = VERSION;
+    header.key = keys[i];
+    header.blob_size = sizes[i];
+
+    // write to a temp file and rename, a crash never leaves a truncated entry behind
+    std::string filename = cache_path(keys[i]);
+    std::string temp_name = fmt::format("{}.{}.tmp", filename, i); // two meshes can have identical contents
+    std::error_code file_ec;
+    {
+      std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+      out.write((const char*) &header, sizeof(header));
+      out.write((const char*) data + offsets[i], sizes[i]);
+      if (!out) {
+        warn_log("Could not write acceleration structure cache, {}", filename);
+        out.close();
+        fs::remove(temp_name, file_ec);
+        return;
+      }
+    }
+    fs::rename(temp_name, filename, file_ec);
+    if (file_ec) warn_log("Could not write acceleration structure cache, {}: {}", filename, file_ec.message());
+  });
+
+  readback.unmap();
+  readback.destroy();
+  info_log("Stored {} blases in the acceleration structure cache, {:.1f} MB", count, total_size / 1048576.0);
+}
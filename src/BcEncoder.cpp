@@ -0,0 +1,180 @@
+#include "BcEncoder.h"
+#include "ThreadPool.h"
+#include <glm/glm.hpp>
+
+// packs fields lsb first into a 128 bit block
+struct BlockWriter {
+  u64 bits[2] {0, 0};
+  u32 pos {0};
+
+  void write(u32 value, u32 count) {
+    for (u32 i = 0; i < count; ++i, ++pos) {
+      bits[pos / 64] |= (u64) ((value >> i) & 1) << (pos % 64);
+    }
+  }
+};
+
+static void fetch_block(const u8* rgba, u32 width, u32 height, u32 bx, u32 by, u8 block[16][4]) {
+  for (u32 y = 0; y < 4; ++y) {
+    for (u32 x = 0; x < 4; ++x) {
+      const u8* texel = rgba + ((size_t) std::min(by*4 + y, height - 1) * width + std::min(bx*4 + x, width - 1)) * 4;
+      memcpy(block[y*4 + x], texel, 4);
+    }
+  }
+}
+
+static const u32 bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// 7 bit endpoint plus a shared p-bit, the p-bit with the smaller rounding error wins
+static void quantize_endpoint(glm::vec4 value, u32 channels[4], u32& p_bit) {
+  float best_error = FLT_MAX;
+  for (u32 p = 0; p < 2; ++p) {
+    u32 candidate[4];
+    float error = 0;
+    for (u32 c = 0; c < 4; ++c) {
+      candidate[c] = (u32) glm::clamp((int) std::lround((value[c] - (float) p) * 0.5f), 0, 127);
+      float restored = (float) ((candidate[c] << 1) | p);
+      error += (restored - value[c]) * (restored - value[c]);
+    }
+    if (error < best_error) {
+      best_error = error;
+      p_bit = p;
+      memcpy(channels, candidate, sizeof(candidate));
+    }
+  }
+}
+
+static void encode_bc7_block(const u8 block[16][4], u8* out) {
+  // endpoints on the principal axis through the block, found with a few power iterations
+  glm::vec4 mean(0);
+  for (u32 i = 0; i < 16; ++i) mean += glm::vec4(block[i][0], block[i][1], block[i][2], block[i][3]);
+  mean /= 16.0f;
+
+  glm::mat4 covariance(0);
+  for (u32 i = 0; i < 16; ++i) {
+    glm::vec4 d = glm::vec4(block[i][0], block[i][1], block[i][2], block[i][3]) - mean;
+    covariance += glm::outerProduct(d, d);
+  }
+  // seeded with the covariance column of the channel that varies most. a fixed rgb seed is orthogonal to blocks
+  // where only alpha varies (masks, foliage), which would collapse both endpoints onto the mean
+  u32 widest = 0;
+  for (u32 c = 1; c < 4; ++c) {
+    if (covariance[c][c] > covariance[widest][widest]) widest = c;
+  }
+  glm::vec4 axis = covariance[widest];
+  for (u32 iteration = 0; iteration < 8; ++iteration) {
+    glm::vec4 next = covariance * axis;
+    float length = glm::length(next);
+    if (length < 1e-6f) break;
+    axis = next / length;
+  }
+  if (glm::length(axis) < 1e-6f) axis = glm::vec4(0.5f);
+  axis = glm::normalize(axis);
+
+  float t_min = FLT_MAX, t_max = -FLT_MAX;
+  for (u32 i = 0; i < 16; ++i) {
+    float t = glm::dot(glm::vec4(block[i][0], block[i][1], block[i][2], block[i][3]) - mean, axis);
+    t_min = std::min(t_min, t);
+    t_max = std::max(t_max, t);
+  }
+
+  u32 endpoints[2][4], p_bits[2];
+  quantize_endpoint(glm::clamp(mean + axis*t_min, 0.0f, 255.0f), endpoints[0], p_bits[0]);
+  quantize_endpoint(glm::clamp(mean + axis*t_max, 0.0f, 255.0f), endpoints[1], p_bits[1]);
+
+  u32 palette[16][4];
+  for (u32 w = 0; w < 16; ++w) {
+    for (u32 c = 0; c < 4; ++c) {
+      u32 e0 = (endpoints[0][c] << 1) | p_bits[0], e1 = (endpoints[1][c] << 1) | p_bits[1];
+      palette[w][c] = ((64 - bc7_weights[w]) * e0 + bc7_weights[w] * e1 + 32) >> 6;
+    }
+  }
+
+  u32 indices[16];
+  for (u32 i = 0; i < 16; ++i) {
+    u32 best_error = UINT32_MAX;
+    for (u32 w = 0; w < 16; ++w) {
+      u32 error = 0;
+      for (u32 c = 0; c < 4; ++c) {
+	int d = (int) palette[w][c] - (int) block[i][c];
+	error += (u32) (d * d);
+      }
+      if (error < best_error) {
+	best_error = error;
+	indices[i] = w;
+      }
+    }
+  }
+
+  // the first index is stored without its top bit, so it has to point at the first half of the palette
+  if (indices[0] & 8) {
+    std::swap(endpoints[0], endpoints[1]);
+    std::swap(p_bits[0], p_bits[1]);
+    for (u32& index : indices) index = 15 - index;
+  }
+
+  BlockWriter writer;
+  writer.write(1 << 6, 7); // mode 6
+  for (u32 c = 0; c < 4; ++c) {
+    writer.write(endpoints[0][c], 7);
+    writer.write(endpoints[1][c], 7);
+  }
+  writer.write(p_bits[0], 1);
+  writer.write(p_bits[1], 1);
+  writer.write(indices[0], 3);
+  for (u32 i = 1; i < 16; ++i) writer.write(indices[i], 4);
+  memcpy(out, writer.bits, 16);
+}
+
+// one bc4 half of a bc5 block, 8 interpolated values between the channel's min and max
+static void encode_bc4_block(const u8 block[16][4], u32 channel, u8* out) {
+  u32 lo = 255, hi = 0;
+  for (u32 i = 0; i < 16; ++i) {
+    lo = std::min(lo, (u32) block[i][channel]);
+    hi = std::max(hi, (u32) block[i][channel]);
+  }
+
+  BlockWriter writer;
+  writer.write(hi, 8);
+  writer.write(lo, 8);
+  if (hi == lo) { // every index 0 decodes to hi in either mode
+    writer.write(0, 48);
+  } else {
+    // palette index 0 = hi, 1 = lo, 2..7 step from hi towards lo
+    static const u32 order[8] = { 0, 2, 3, 4, 5, 6, 7, 1 };
+    for (u32 i = 0; i < 16; ++i) {
+      u32 step = ((block[i][channel] - lo) * 14 + (hi - lo)) / (2 * (hi - lo)); // 0..7, 7 = hi
+      writer.write(order[7 - step], 3);
+    }
+  }
+  memcpy(out, writer.bits, 8);
+}
+
+template <typename F>
+static void encode_blocks(const u8* rgba, u32 width, u32 height, u8* out, F&& encode_block) {
+  u32 blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+  thread_pool.parallel_for(blocks_y, [&](u32 by) {
+    u8 block[16][4];
+    for (u32 bx = 0; bx < blocks_x; ++bx) {
+      fetch_block(rgba, width, height, bx, by, block);
+      encode_block(block, out + ((size_t) by * blocks_x + bx) * 16);
+    }
+  });
+}
+
+namespace BcEncoder {
+
+void encode_bc7(const u8* rgba, u32 width, u32 height, u8* out) {
+  encode_blocks(rgba, width, height, out, [](const u8 block[16][4], u8* block_out) {
+    encode_bc7_block(block, block_out);
+  });
+}
+
+void encode_bc5(const u8* rgba, u32 width, u32 height, u8* out) {
+  encode_blocks(rgba, width, height, out, [](const u8 block[16][4], u8* block_out) {
+    encode_bc4_block(block, 0, block_out);
+    encode_bc4_block(block, 1, block_out + 8);
+  });
+}
+
+};
@@ -2,14 +2,22 @@
 #include "Blas.h"
 #include "CmdUtils.h"
 #include "Scene.h"
+#include "Util.h"
 
 void AccelStructure::create(VkAccelerationStructureCreateInfoKHR &create_info, VmaMemoryUsage mem_usage) {
+  size = create_info.size;
   buffer.create(create_info.size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
   create_info.buffer = buffer.buffer;
   vkCreateAccelerationStructureKHR(vkcontext.device, &create_info, nullptr, &accel);
 }
 
-void Blas::add_buffers(AllocatedBuffer& vbo, AllocatedBuffer& ibo, u32 max_vertices, u32 max_indices) {
+void AccelStructure::destroy() {
+  vkDestroyAccelerationStructureKHR(vkcontext.device, accel, nullptr);
+  buffer.destroy();
+  accel = VK_NULL_HANDLE;
+}
+
+void Blas::add_buffers(AllocatedBuffer& vbo, AllocatedBuffer& ibo, u32 max_vertices, u32 max_indices, u32 first_vertex, u32 first_index) {
   VkDeviceAddress vbo_addr = vbo.get_device_addr();
   VkDeviceAddress ibo_addr = ibo.get_device_addr();
 
@@ -20,7 +28,7 @@ void Blas::add_buffers(AllocatedBuffer& vbo, AllocatedBuffer& ibo, u32 max_verti
   vertex_data.indexType = VK_INDEX_TYPE_UINT32;
   vertex_data.transformData = {};
   vertex_data.vertexStride = {sizeof(Vert)};
-  vertex_data.maxVertex = max_vertices;
+  vertex_data.maxVertex = first_vertex + max_vertices;
 
   geometry_info.vertex_data.emplace_back(vertex_data);
 
@@ -32,18 +40,22 @@ void Blas::add_buffers(AllocatedBuffer& vbo, AllocatedBuffer& ibo, u32 max_verti
   geometry_info.as_geometry.emplace_back(as_geometry);
 
   VkAccelerationStructureBuildRangeInfoKHR offset = {};
-  offset.firstVertex = 0;
+  // indices stay relative to the mesh, firstVertex rebases them into the shared vertex buffer
+  offset.firstVertex = first_vertex;
   offset.primitiveCount = max_indices/3;
-  offset.primitiveOffset = 0;
+  offset.primitiveOffset = first_index*sizeof(u32);
   offset.transformOffset = 0;
   geometry_info.offset.emplace_back(offset);
 
 }
 
-void Blas::build_blas(Blas* blases, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags) {
+void Blas::build_blas(Blas* blases, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags, VkDeviceSize scratch_budget) {
   if(!count) return;
 
+  VkDeviceSize scratch_align = std::max<VkDeviceSize>(vkcontext.device_props.as_properties.minAccelerationStructureScratchOffsetAlignment, 1);
   std::vector<VkAccelerationStructureBuildGeometryInfoKHR> build_infos(count);
+  std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> range_infos(count);
+  std::vector<VkDeviceSize> scratch_sizes(count);
   for (u32 i = 0; i < count; ++i) {
     build_infos[i] = {};
     build_infos[i].sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
@@ -53,9 +65,8 @@ void Blas::build_blas(Blas* blases, u32 count, VkBuildAccelerationStructureFlags
     build_infos[i].mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
     build_infos[i].type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
     build_infos[i].srcAccelerationStructure = VK_NULL_HANDLE;
-  }
-  VkDeviceSize max_scratch {0};
-  for (u32 i = 0; i < count; ++i) {
+    range_infos[i] = blases[i].geometry_info.offset.data();
+
     std::vector<u32> max_prim_count(blases[i].geometry_info.offset.size());
     for (u32 j = 0; j < blases[i].geometry_info.offset.size(); ++j)
       max_prim_count[j]=blases[i].geometry_info.offset[j].primitiveCount;
@@ -69,50 +80,98 @@ void Blas::build_blas(Blas* blases, u32 count, VkBuildAccelerationStructureFlags
 
     blases[i].accel_structure.create(as_info);
     build_infos[i].dstAccelerationStructure = blases[i].accel_structure.accel;
-
-    max_scratch = std::max(max_scratch, size_info.buildScratchSize);
+    scratch_sizes[i] = util::align_up(size_info.buildScratchSize, scratch_align);
   }
-  
-  assert(max_scratch && "scratch memory requirements returned 0");
-  AllocatedBuffer scratch_buffer;
-  scratch_buffer.create(max_scratch, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-
-  VkDeviceAddress scratch_addr {scratch_buffer.get_device_addr()};
 
-  std::vector<VkCommandBuffer> cmd_buffers(count);
-  vkutil::get_cmd_buffers(cmd_buffers.data(), count);
+  // consecutive builds are grouped until their scratch memory would exceed the budget, a single
+  // build over budget gets a batch of its own. every build in a batch has its own slice of scratch
+  std::vector<u32> batch_starts;
+  VkDeviceSize scratch_size {0}, batch_scratch {0};
   for (u32 i = 0; i < count; ++i) {
-    VkCommandBuffer& cmd_buffer = cmd_buffers[i];
-    VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    VK_CHECK(vkBeginCommandBuffer(cmd_buffer, &begin_info));
-    build_infos[i].scratchData.deviceAddress = scratch_addr;
-
-    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *> pBuildOffset(blases[i].geometry_info.offset.size());
-    for (size_t j = 0; j < blases[i].geometry_info.offset.size(); ++j)
-      pBuildOffset[j] = &blases[i].geometry_info.offset[j];
-
-    vkCmdBuildAccelerationStructuresKHR(cmd_buffer, 1, &build_infos[i], pBuildOffset.data());
-    VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
-    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
-    vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
-    VK_CHECK(vkEndCommandBuffer(cmd_buffer));
+    if (batch_starts.empty() || batch_scratch + scratch_sizes[i] > scratch_budget) {
+      batch_starts.push_back(i);
+      batch_scratch = 0;
+    }
+    batch_scratch += scratch_sizes[i];
+    scratch_size = std::max(scratch_size, batch_scratch);
   }
-  VkFence build_done = vkutil::submit_cmd_buffers(cmd_buffers.data(), count);
-  VkResult result = vkWaitForFences(vkcontext.device, 1, &build_done, VK_TRUE, UINT64_MAX);
-  if (result != VK_SUCCESS) {
-    err_log("vk_error waiting for blases to build: {}", result);
+  batch_starts.push_back(count);
+
+  // compacted sizes are only known once the builds ran, they are read back through a query pool
+  bool compact = build_flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+  VkQueryPool query_pool = VK_NULL_HANDLE;
+  std::vector<VkAccelerationStructureKHR> accels(count);
+  if (compact) {
+    VkQueryPoolCreateInfo query_info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+    query_info.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+    query_info.queryCount = count;
+    VK_CHECK(vkCreateQueryPool(vkcontext.device, &query_info, nullptr, &query_pool));
+    for (u32 i = 0; i < count; ++i) accels[i] = blases[i].accel_structure.accel;
   }
-  vkutil::free_cmd_buffers(cmd_buffers.data(), count);
+
+  assert(scratch_size && "scratch memory requirements returned 0");
+  AllocatedBuffer scratch_buffer;
+  scratch_buffer.create(scratch_size + scratch_align, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  VkDeviceAddress scratch_addr = util::align_up(scratch_buffer.get_device_addr(), scratch_align);
+
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    if (compact) vkCmdResetQueryPool(cmd, query_pool, 0, count);
+    for (size_t b = 0; b + 1 < batch_starts.size(); ++b) {
+      u32 first = batch_starts[b], batch_count = batch_starts[b + 1] - first;
+      VkDeviceAddress offset = scratch_addr;
+      for (u32 i = first; i < first + batch_count; ++i) {
+        build_infos[i].scratchData.deviceAddress = offset;
+        offset += scratch_sizes[i];
+      }
+      vkCmdBuildAccelerationStructuresKHR(cmd, batch_count, &build_infos[first], &range_infos[first]);
+
+      // the next batch reuses the same scratch memory
+      VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+      barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+      barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+      vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+    if (compact) vkCmdWriteAccelerationStructuresPropertiesKHR(cmd, count, accels.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, query_pool, 0);
+  });
+  info_log("Built {} blases in {} batches, {} MB of scratch", count, batch_starts.size() - 1, scratch_size >> 20);
   scratch_buffer.destroy();
+
+  if (compact) {
+    compact_blas(blases, count, query_pool);
+    vkDestroyQueryPool(vkcontext.device, query_pool, nullptr);
+  }
 }
 
-VkAccelerationStructureInstanceKHR Instance::toVkGeometryInstanceKHR(Blas *blas, u32 instance_id) const {
-  VkAccelerationStructureDeviceAddressInfoKHR address_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR };
-  address_info.accelerationStructure = blas[vert_id].accel_structure.accel;
-  VkDeviceAddress blas_addr = vkGetAccelerationStructureDeviceAddressKHR(vkcontext.device, &address_info);
-  
+void Blas::compact_blas(Blas* blases, u32 count, VkQueryPool query_pool) {
+  std::vector<VkDeviceSize> compact_sizes(count);
+  VK_CHECK(vkGetQueryPoolResults(vkcontext.device, query_pool, 0, count, count*sizeof(VkDeviceSize), compact_sizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+  std::vector<AccelStructure> originals(count);
+  VkDeviceSize original_size {0}, compacted_size {0};
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    for (u32 i = 0; i < count; ++i) {
+      originals[i] = blases[i].accel_structure;
+      original_size += originals[i].size;
+      compacted_size += compact_sizes[i];
+
+      VkAccelerationStructureCreateInfoKHR as_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR };
+      as_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+      as_info.size = compact_sizes[i];
+      blases[i].accel_structure.create(as_info);
+
+      VkCopyAccelerationStructureInfoKHR copy_info = { VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR };
+      copy_info.src = originals[i].accel;
+      copy_info.dst = blases[i].accel_structure.accel;
+      copy_info.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+      vkCmdCopyAccelerationStructureKHR(cmd, &copy_info);
+    }
+  });
+  for (AccelStructure& original : originals) original.destroy();
+
+  info_log("Compacted {} blases from {:.1f} MB to {:.1f} MB, saved {:.1f} MB", count, original_size / 1048576.0, compacted_size / 1048576.0, (original_size - compacted_size) / 1048576.0);
+}
+
+VkAccelerationStructureInstanceKHR Instance::toVkGeometryInstanceKHR(VkDeviceAddress blas_addr, u32 instance_id) const {
   VkAccelerationStructureInstanceKHR instance_khr;
   // instance_khr.transform is a 4x3 matrix
   // saving the last row that is anyway always (0, 0, 0, 1)
@@ -141,67 +200,110 @@ void Tlas::add_instance(u32 vert_id, u32 hit_group_id, glm::mat4& transform) {
 
 void Tlas::build_tlas(Blas *blas, u32 count, VkBuildAccelerationStructureFlagsKHR build_flags) {
   assert_log(count == instances.size(), "given count and instances.size() do not match");
+  flags = build_flags;
+
+  // one slice of instances per frame in flight, a refit only ever writes the slice of the frame being recorded
+  VkDeviceSize slice_size = instances.size()*sizeof(VkAccelerationStructureInstanceKHR);
+  instance_buffer.create(NUM_FRAMES*slice_size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+  instance_data = (VkAccelerationStructureInstanceKHR*) instance_buffer.map();
+  instance_addr = instance_buffer.get_device_addr();
+
+  VkAccelerationStructureBuildGeometryInfoKHR build_info = build_geometry_info(VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, 0);
+  VkAccelerationStructureBuildSizesInfoKHR size_info { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+  vkGetAccelerationStructureBuildSizesKHR(vkcontext.device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &build_info, &count, &size_info);
+
+  VkAccelerationStructureCreateInfoKHR create_info { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+  create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+  create_info.size = size_info.accelerationStructureSize;
+  accel_structure.create(create_info);
+
+  // the scratch is kept around for refits
+  VkDeviceSize scratch_align = std::max<VkDeviceSize>(vkcontext.device_props.as_properties.minAccelerationStructureScratchOffsetAlignment, 1);
+  VkDeviceSize scratch_size = std::max(size_info.buildScratchSize, size_info.updateScratchSize);
+  scratch_buffer.create(scratch_size + scratch_align, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  scratch_addr = util::align_up(scratch_buffer.get_device_addr(), scratch_align);
+
+  blas_addrs.resize(instances.size());
+  for (size_t i = 0; i < instances.size(); ++i) {
+    VkAccelerationStructureDeviceAddressInfoKHR address_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR };
+    address_info.accelerationStructure = blas[instances[i].vert_id].accel_structure.accel;
+    blas_addrs[i] = vkGetAccelerationStructureDeviceAddressKHR(vkcontext.device, &address_info);
+  }
 
-  AllocatedBuffer scratch_buffer;
+  write_instances(0);
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    record_build(cmd, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, 0);
+  });
+  dirty = false;
+}
 
-  std::vector<VkAccelerationStructureInstanceKHR> geometry_instances;
-  geometry_instances.reserve(instances.size());
-  u32 instance_id = 0;
-  // NOTE: the order of instances matter! has to be same order as the geometry buffer on gpu
-  for (const auto &inst : instances) {
-    geometry_instances.push_back(inst.toVkGeometryInstanceKHR(blas, instance_id++));
+void Tlas::set_transform(u32 instance_id, const glm::mat4& transform) {
+  instances[instance_id].transform = transform;
+  dirty = true;
+}
+
+bool Tlas::update(VkCommandBuffer cmd) {
+  if (!dirty) return false;
+  if (!(flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR)) {
+    err_log("tlas was built without ALLOW_UPDATE, instance transforms are ignored");
+    dirty = false;
+    return false;
   }
 
-  bool update = false; // TODO: take as parameter 
-  VkDeviceSize instance_desc_size = instances.size()*sizeof(VkAccelerationStructureInstanceKHR);
-  const void* instance_data = geometry_instances.data();
+  u32 slice = vkcontext.current_frame;
+  write_instances(slice);
 
-  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
-    instance_buffer.create(cmd, instance_desc_size, instance_data, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-    VkDeviceAddress instance_addr = instance_buffer.get_device_addr();
-    VkMemoryBarrier barrier { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
-
-
-    VkAccelerationStructureGeometryInstancesDataKHR instances_vk { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR};
-    instances_vk.arrayOfPointers = VK_FALSE;
-    instances_vk.data.deviceAddress = instance_addr;
-
-    VkAccelerationStructureGeometryKHR topASGeometry { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
-    topASGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    topASGeometry.geometry.instances = instances_vk;
-
-    VkAccelerationStructureBuildGeometryInfoKHR topASInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
-    topASInfo.flags                     = build_flags;
-    topASInfo.geometryCount             = 1;
-    topASInfo.pGeometries              = &topASGeometry;
-    topASInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    topASInfo.srcAccelerationStructure  = VK_NULL_HANDLE;
-
-    u32 count = (u32)instances.size();
-    VkAccelerationStructureBuildSizesInfoKHR size_info { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
-    vkGetAccelerationStructureBuildSizesKHR(vkcontext.device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &topASInfo, &count, &size_info);
-    if (update == false) {
-      VkAccelerationStructureCreateInfoKHR create_info { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
-      create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-      create_info.size = size_info.accelerationStructureSize;
-      accel_structure.create(create_info);
-    }
-    scratch_buffer.create(size_info.buildScratchSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-    VkDeviceAddress scratch_addr = scratch_buffer.get_device_addr();
-    
-    topASInfo.srcAccelerationStructure = update ? accel_structure.accel : VK_NULL_HANDLE;
-    topASInfo.dstAccelerationStructure = accel_structure.accel;
-    topASInfo.scratchData.deviceAddress = scratch_addr;
+  // earlier frames may still be tracing against the tlas that is refit in place
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+  barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+  barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-    VkAccelerationStructureBuildRangeInfoKHR buildOffsetInfo{static_cast<uint32_t>(instances.size()), 0, 0, 0};
-    const VkAccelerationStructureBuildRangeInfoKHR* pBuildOffsetInfo = &buildOffsetInfo;
+  record_build(cmd, VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR, slice);
 
-    vkCmdBuildAccelerationStructuresKHR(cmd, 1, &topASInfo, &pBuildOffsetInfo);
-  });
-  scratch_buffer.destroy();
+  barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+  barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+  dirty = false;
+  return true;
+}
+
+void Tlas::write_instances(u32 slice) {
+  // NOTE: the order of instances matter! has to be same order as the geometry buffer on gpu
+  VkAccelerationStructureInstanceKHR* dst = instance_data + slice*instances.size();
+  for (size_t i = 0; i < instances.size(); ++i) {
+    dst[i] = instances[i].toVkGeometryInstanceKHR(blas_addrs[i], (u32) i);
+  }
+  VkDeviceSize slice_size = instances.size()*sizeof(VkAccelerationStructureInstanceKHR);
+  vmaFlushAllocation(vkallocator, instance_buffer.allocation, slice*slice_size, slice_size);
+}
+
+VkAccelerationStructureBuildGeometryInfoKHR Tlas::build_geometry_info(VkBuildAccelerationStructureModeKHR mode, u32 slice) {
+  geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+  geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+  geometry.geometry.instances = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR };
+  geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+  geometry.geometry.instances.data.deviceAddress = instance_addr + slice*instances.size()*sizeof(VkAccelerationStructureInstanceKHR);
+
+  VkAccelerationStructureBuildGeometryInfoKHR build_info { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
+  build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+  build_info.flags = flags;
+  build_info.mode = mode;
+  build_info.geometryCount = 1;
+  build_info.pGeometries = &geometry;
+  return build_info;
+}
+
+void Tlas::record_build(VkCommandBuffer cmd, VkBuildAccelerationStructureModeKHR mode, u32 slice) {
+  VkAccelerationStructureBuildGeometryInfoKHR build_info = build_geometry_info(mode, slice);
+  // an update refits in place
+  build_info.srcAccelerationStructure = mode == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR ? accel_structure.accel : VK_NULL_HANDLE;
+  build_info.dstAccelerationStructure = accel_structure.accel;
+  build_info.scratchData.deviceAddress = scratch_addr;
+
+  VkAccelerationStructureBuildRangeInfoKHR range_info { (u32) instances.size(), 0, 0, 0 };
+  const VkAccelerationStructureBuildRangeInfoKHR* p_range_info = &range_info;
+  vkCmdBuildAccelerationStructuresKHR(cmd, 1, &build_info, &p_range_info);
 }
 
 VkWriteDescriptorSetAccelerationStructureKHR* Tlas::get_desc_info() {
@@ -1,5 +1,6 @@
 #include "Buffer.h"
 #include "Context.h"
+#include "StagingRing.h"
 #include <glm/ext.hpp>
 // Vertex::Vertex(float x, float y, float z, float ux, float uy) {
 //   position = glm::vec3(x, y, z);
@@ -65,6 +66,7 @@ void AllocatedBuffer::create(size_t size, VkBufferUsageFlags usage, VmaMemoryUsa
   VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
   buffer_info.size = size;
   buffer_info.usage = usage;
+  share_with_transfer_queue(buffer_info);
 
   VmaAllocationCreateInfo alloc_info = {};
   alloc_info.usage = mem_usage;
@@ -121,14 +123,10 @@ namespace vkcmd {
     if (!size || !buffer)
       return;
   
-    AllocatedBuffer staging;
-    staging.create(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-    void *mapping = staging.map();
-    memcpy(mapping, data, size);
-    staging.unmap();
+    StagingAlloc staging = vkstaging.stage(data, size, 4);
     VkBufferCopy cpy {};
     cpy.size = size;
-    cpy.srcOffset = 0;
+    cpy.srcOffset = staging.offset;
     cpy.dstOffset = offset;
     vkCmdCopyBuffer(cmd, staging.buffer, buffer, 1, &cpy);
   }
@@ -2,19 +2,25 @@
 #include "Common.h"
 #include "glm/ext.hpp"
 
-Camera::Camera(glm::vec3 initial_pos, glm::vec3 look_at, float fov) {
+Camera::Camera(glm::vec3 initial_pos, glm::vec3 look_at, float fov, glm::uvec2 resolution) {
   m_Pos = initial_pos;
   m_Dir = glm::normalize(look_at - initial_pos);
   m_Pitch = glm::degrees(asin(m_Dir.y));
   m_Yaw = glm::degrees(atan2(m_Dir.z, m_Dir.x));
+  m_Fov = fov;
   
   cameraData.view = glm::lookAt(initial_pos, m_Dir, m_Up);
   cameraData.view_inverse = glm::inverse(cameraData.view);
-  cameraData.proj = glm::perspective(glm::radians(fov), (float)1920 / (float)1080, 0.1f, 2000.0f);
+  set_resolution(resolution);
+}
+
+void Camera::set_resolution(glm::uvec2 resolution) {
+  prevX = resolution.x/2.0f;
+  prevY = resolution.y/2.0f;
+  cameraData.proj = glm::perspective(glm::radians(m_Fov), (float)resolution.x / (float)resolution.y, 0.1f, 2000.0f);
   cameraData.proj_inverse = glm::inverse(cameraData.proj);
   cameraData.proj[1][1] *= -1;
   cameraData.proj_inverse[1][1] *= -1;
-  ubo.create(sizeof(CameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
 }
 
 void Camera::mouse_callback(GLFWwindow* window, double xpos, double ypos) {
@@ -1,13 +1,39 @@
 #include "CmdUtils.h"
 #include "Context.h"
+#include "StagingRing.h"
+#include <deque>
 
 static VkCommandPool one_time_pool = VK_NULL_HANDLE;
 
+// uploads run on their own pool and queue, a timeline semaphore counts the finished ones
+static VkCommandPool transfer_pool = VK_NULL_HANDLE;
+static VkSemaphore upload_timeline = VK_NULL_HANDLE;
+static u64 upload_value = 0;
+static u64 pending_gpu_wait = 0;
+struct UploadCmd {
+  VkCommandBuffer cmd;
+  u64 value;
+};
+static std::deque<UploadCmd> uploads_in_flight;
+
 namespace vkutil {
 
 void init_utils() {
   VkCommandPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
   VK_CHECK(vkCreateCommandPool(vkcontext.device, &pool_info, nullptr, &one_time_pool));
+
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = vkcontext.device_props.transfer_index;
+  VK_CHECK(vkCreateCommandPool(vkcontext.device, &pool_info, nullptr, &transfer_pool));
+
+  VkSemaphoreTypeCreateInfo type_info = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+  type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  type_info.initialValue = 0;
+  VkSemaphoreCreateInfo semaphore_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+  semaphore_info.pNext = &type_info;
+  VK_CHECK(vkCreateSemaphore(vkcontext.device, &semaphore_info, nullptr, &upload_timeline));
+
+  vkstaging.init();
 }
 
 void immediate_submit(std::function<void(VkCommandBuffer)> execute_cmds) {
@@ -30,9 +56,23 @@ void immediate_submit(std::function<void(VkCommandBuffer)> execute_cmds) {
   submit_info.commandBufferCount = 1;
   submit_info.pCommandBuffers = &cmd_buffer;
 
-  VK_CHECK(vkQueueSubmit(vkcontext.graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
+  UploadWait upload;
+  VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  VkTimelineSemaphoreSubmitInfo timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+  if (take_upload_wait(upload)) {
+    timeline_info.waitSemaphoreValueCount = 1;
+    timeline_info.pWaitSemaphoreValues = &upload.value;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &upload.semaphore;
+    submit_info.pWaitDstStageMask = &wait_stage;
+  }
 
-  VK_CHECK(vkQueueWaitIdle(vkcontext.graphics_queue));
+  // the fence also hands this submit's staging space back to the ring
+  VkFence fence = vkstaging.close_batch();
+  VK_CHECK(vkQueueSubmit(vkcontext.graphics_queue, 1, &submit_info, fence));
+
+  vkstaging.wait(fence);
   vkFreeCommandBuffers(vkcontext.device, one_time_pool, 1, &cmd_buffer);
 }
 
@@ -59,4 +99,68 @@ VkFence submit_cmd_buffers(VkCommandBuffer *buffers, u32 count) {
 void free_cmd_buffers(VkCommandBuffer *buffers, u32 count) {
   vkFreeCommandBuffers(vkcontext.device, one_time_pool, count, buffers);
 }
+
+static void free_finished_uploads() {
+  u64 finished;
+  VK_CHECK(vkGetSemaphoreCounterValue(vkcontext.device, upload_timeline, &finished));
+  while (!uploads_in_flight.empty() && uploads_in_flight.front().value <= finished) {
+    vkFreeCommandBuffers(vkcontext.device, transfer_pool, 1, &uploads_in_flight.front().cmd);
+    uploads_in_flight.pop_front();
+  }
+  vkstaging.reclaim();
+}
+
+u64 upload_async(std::function<void(VkCommandBuffer)> record_cmds) {
+  free_finished_uploads();
+
+  VkCommandBufferAllocateInfo allocate_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+  allocate_info.commandBufferCount = 1;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandPool = transfer_pool;
+
+  VkCommandBuffer cmd_buffer;
+  VK_CHECK(vkAllocateCommandBuffers(vkcontext.device, &allocate_info, &cmd_buffer));
+
+  VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkBeginCommandBuffer(cmd_buffer, &begin_info));
+  record_cmds(cmd_buffer);
+  VK_CHECK(vkEndCommandBuffer(cmd_buffer));
+
+  u64 value = ++upload_value;
+  VkTimelineSemaphoreSubmitInfo timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &value;
+
+  VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+  submit_info.pNext = &timeline_info;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &cmd_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &upload_timeline;
+  VK_CHECK(vkQueueSubmit(vkcontext.transfer_queue, 1, &submit_info, vkstaging.close_batch()));
+
+  uploads_in_flight.push_back({ cmd_buffer, value });
+  return value;
+}
+
+void wait_upload(u64 value) {
+  VkSemaphoreWaitInfo wait_info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &upload_timeline;
+  wait_info.pValues = &value;
+  VK_CHECK(vkWaitSemaphores(vkcontext.device, &wait_info, UINT64_MAX));
+  free_finished_uploads();
+}
+
+void gpu_wait_upload(u64 value) {
+  pending_gpu_wait = std::max(pending_gpu_wait, value);
+}
+
+bool take_upload_wait(UploadWait& wait) {
+  if (pending_gpu_wait == 0) return false;
+  wait = { upload_timeline, pending_gpu_wait };
+  pending_gpu_wait = 0;
+  return true;
+}
 };
@@ -9,6 +9,7 @@
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_vulkan.h"
 #include "RtProgram.h"
+#include "ShaderCache.h"
 
 VkContext vkcontext;
 VmaAllocator vkallocator;
@@ -21,25 +22,40 @@ void VulkanContext::init_instance() {
   application_info.apiVersion = VK_API_VERSION_1_2;
   application_info.pApplicationName = "Raytracing Test";
 
-  const char* enabled_layers[] = {
+  std::vector<const char*> requested_layers = {
     #ifdef VALIDATION_LAYERS
     "VK_LAYER_KHRONOS_validation",
     #endif
-    "VK_LAYER_LUNARG_monitor",
   };
+  if (!vkcontext.headless) requested_layers.push_back("VK_LAYER_LUNARG_monitor"); // overlay, needs a window
 
-  u32 extension_count;
-  glfwGetRequiredInstanceExtensions(&extension_count);
-  const char** required_extensions = glfwGetRequiredInstanceExtensions(&extension_count);
+  // render nodes usually do not have the sdk layers installed, only enable the ones that exist
+  u32 layer_count;
+  vkEnumerateInstanceLayerProperties(&layer_count, nullptr);
+  std::vector<VkLayerProperties> available_layers(layer_count);
+  vkEnumerateInstanceLayerProperties(&layer_count, available_layers.data());
 
-  std::vector<const char*> instance_extensions(required_extensions, required_extensions+extension_count);
+  std::vector<const char*> enabled_layers;
+  for (const char* layer : requested_layers) {
+    bool found = false;
+    for (const auto& props : available_layers) found = found || strcmp(props.layerName, layer) == 0;
+    if (found) enabled_layers.push_back(layer);
+    else warn_log("Instance layer not present, skipping: {}", layer);
+  }
+
+  std::vector<const char*> instance_extensions;
+  if (!vkcontext.headless) {
+    u32 extension_count;
+    const char** required_extensions = glfwGetRequiredInstanceExtensions(&extension_count);
+    instance_extensions.assign(required_extensions, required_extensions+extension_count);
+  }
   instance_extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 
   VkInstanceCreateInfo instance_info = { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO };
   instance_info.enabledExtensionCount = (u32) instance_extensions.size();
   instance_info.ppEnabledExtensionNames = instance_extensions.data();
-  instance_info.enabledLayerCount = COUNT_OF(enabled_layers);
-  instance_info.ppEnabledLayerNames = enabled_layers;
+  instance_info.enabledLayerCount = (u32) enabled_layers.size();
+  instance_info.ppEnabledLayerNames = enabled_layers.data();
   instance_info.pApplicationInfo = &application_info;
 
   VK_CHECK(vkCreateInstance(&instance_info, nullptr, &vkcontext.instance));
@@ -76,33 +92,58 @@ void VulkanContext::init_device() {
     VK_CHECK(vkEnumeratePhysicalDevices(vkcontext.instance, &count, phys_devices.data()));
     assert_log(count > 0, "vkEnumeratePhysicalDevices returned 0");
 
+    // discrete gpus are always preferred, headless runs also accept integrated and software (lavapipe) devices
+    auto device_rank = [](VkPhysicalDeviceType type) -> int {
+      switch (type) {
+	case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 3;
+	case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return vkcontext.headless ? 2 : 0;
+	case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return vkcontext.headless ? 1 : 0;
+	case VK_PHYSICAL_DEVICE_TYPE_CPU: return vkcontext.headless ? 1 : 0;
+	default: return 0;
+      }
+    };
+
     bool found = false;
+    int best_rank = 0;
+    VkPhysicalDeviceProperties selected_props;
     for (const auto &device : phys_devices) {
       VkPhysicalDeviceFeatures device_features;
       vkGetPhysicalDeviceFeatures(device, &device_features);
       VkPhysicalDeviceProperties2 phys_device_prop = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
       VkPhysicalDeviceRayTracingPipelinePropertiesKHR rt_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR };
-      rt_properties.pNext = nullptr;
+      VkPhysicalDeviceAccelerationStructurePropertiesKHR as_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR };
+      VkPhysicalDeviceIDProperties id_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES };
+      rt_properties.pNext = &as_properties;
+      as_properties.pNext = &id_properties;
       phys_device_prop.pNext = &rt_properties;
       vkGetPhysicalDeviceProperties2(device, &phys_device_prop);
-      if(device_features.samplerAnisotropy && phys_device_prop.properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU && !found) {
-	info_log("Device Selected: {}", phys_device_prop.properties.deviceName);
-	info_log("Api Version: {}.{}.{}"
-		 , VK_VERSION_MAJOR(phys_device_prop.properties.apiVersion)
-		 , VK_VERSION_MINOR(phys_device_prop.properties.apiVersion)
-		 , VK_VERSION_PATCH(phys_device_prop.properties.apiVersion));
-
-	info_log("Driver Version: {}.{}.{}"
-		 , VK_VERSION_MAJOR(phys_device_prop.properties.driverVersion)
-		 , VK_VERSION_MINOR(phys_device_prop.properties.driverVersion)
-		 , VK_VERSION_PATCH(phys_device_prop.properties.driverVersion));
-
+      int rank = device_rank(phys_device_prop.properties.deviceType);
+      // scene textures are uploaded block compressed, see TextureCache
+      if(device_features.samplerAnisotropy && device_features.textureCompressionBC && rank > best_rank) {
 	vkcontext.phys_device = device;
 	vkcontext.device_props.rt_properties = rt_properties;
+	vkcontext.device_props.rt_properties.pNext = nullptr;
+	vkcontext.device_props.as_properties = as_properties;
+	vkcontext.device_props.as_properties.pNext = nullptr;
+	vkcontext.device_props.id_properties = id_properties;
+	vkcontext.device_props.id_properties.pNext = nullptr;
+	selected_props = phys_device_prop.properties;
+	best_rank = rank;
 	found = true;
       }
     }
     assert(found && "Could not find a physical device with raytracing support");
+
+    info_log("Device Selected: {}", selected_props.deviceName);
+    info_log("Api Version: {}.{}.{}"
+	     , VK_VERSION_MAJOR(selected_props.apiVersion)
+	     , VK_VERSION_MINOR(selected_props.apiVersion)
+	     , VK_VERSION_PATCH(selected_props.apiVersion));
+
+    info_log("Driver Version: {}.{}.{}"
+	     , VK_VERSION_MAJOR(selected_props.driverVersion)
+	     , VK_VERSION_MINOR(selected_props.driverVersion)
+	     , VK_VERSION_PATCH(selected_props.driverVersion));
   }
   // create vulkan device
   {
@@ -113,11 +154,25 @@ void VulkanContext::init_device() {
 
     u32 queue_index = 0;
     for (const auto& queue : device_queues) {
-      if (queue.queueFlags & ( VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_TRANSFER_BIT )) break;
+      if (queue.queueFlags & VK_QUEUE_GRAPHICS_BIT) break;
       ++queue_index;
     }
     vkcontext.device_props.graphics_index = queue_index;
 
+    // a transfer only family is backed by the copy engines, uploads there run alongside graphics work.
+    // devices without one upload on the graphics queue
+    vkcontext.device_props.transfer_index = queue_index;
+    for (u32 i = 0; i < family_count; ++i) {
+      VkQueueFlags flags = device_queues[i].queueFlags;
+      if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+	vkcontext.device_props.transfer_index = i;
+	break;
+      }
+    }
+
+    vkcontext.device_props.queue_families[0] = vkcontext.device_props.graphics_index;
+    vkcontext.device_props.queue_families[1] = vkcontext.device_props.transfer_index;
+
     float queue_prios[] = { 1.0f };
     VkDeviceQueueCreateInfo graphics_queue_info = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
     graphics_queue_info.queueFamilyIndex = vkcontext.device_props.graphics_index;
@@ -126,10 +181,13 @@ void VulkanContext::init_device() {
 
     std::vector<VkDeviceQueueCreateInfo> queue_infos(1);
     queue_infos[0] = graphics_queue_info;
+    if (vkcontext.device_props.transfer_index != vkcontext.device_props.graphics_index) {
+      VkDeviceQueueCreateInfo transfer_queue_info = graphics_queue_info;
+      transfer_queue_info.queueFamilyIndex = vkcontext.device_props.transfer_index;
+      queue_infos.push_back(transfer_queue_info);
+    }
 
-    const char *deviceExtensions[] = {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-
+    std::vector<const char*> deviceExtensions = {
 	VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
 	VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
 	
@@ -138,6 +196,7 @@ void VulkanContext::init_device() {
         VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
         VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
     };
+    if (!vkcontext.headless) deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
     VkPhysicalDeviceDescriptorIndexingFeatures descIndexingFeature = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES };
     descIndexingFeature.runtimeDescriptorArray = VK_TRUE;
@@ -157,17 +216,22 @@ void VulkanContext::init_device() {
     scalarBlockLayoutFeature.scalarBlockLayout = VK_TRUE;
     scalarBlockLayoutFeature.pNext = &raytracingFeature;
 
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeature = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES };
+    timelineSemaphoreFeature.timelineSemaphore = VK_TRUE;
+    timelineSemaphoreFeature.pNext = &scalarBlockLayoutFeature;
+
     VkPhysicalDeviceBufferDeviceAddressFeatures deviceaddressFeature = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES };
     deviceaddressFeature.bufferDeviceAddress = VK_TRUE;
-    deviceaddressFeature.pNext = &scalarBlockLayoutFeature;
+    deviceaddressFeature.pNext = &timelineSemaphoreFeature;
 
     VkPhysicalDeviceFeatures2 deviceFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
     deviceFeatures.pNext = &deviceaddressFeature;
     deviceFeatures.features.samplerAnisotropy = VK_TRUE;
+    deviceFeatures.features.textureCompressionBC = VK_TRUE;
 
     VkDeviceCreateInfo deviceInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
-    deviceInfo.enabledExtensionCount = COUNT_OF(deviceExtensions);
-    deviceInfo.ppEnabledExtensionNames = deviceExtensions;
+    deviceInfo.enabledExtensionCount = (u32) deviceExtensions.size();
+    deviceInfo.ppEnabledExtensionNames = deviceExtensions.data();
     deviceInfo.queueCreateInfoCount = (u32) queue_infos.size();
     deviceInfo.pQueueCreateInfos = queue_infos.data();
     deviceInfo.pNext = &deviceFeatures;
@@ -178,7 +242,8 @@ void VulkanContext::init_device() {
 
     vkGetDeviceQueue(vkcontext.device, vkcontext.device_props.graphics_index, 0, &vkcontext.graphics_queue);
     vkcontext.present_queue = vkcontext.graphics_queue;
-    vkcontext.transfer_queue = vkcontext.graphics_queue;
+    vkGetDeviceQueue(vkcontext.device, vkcontext.device_props.transfer_index, 0, &vkcontext.transfer_queue);
+    if (vkcontext.transfer_queue != vkcontext.graphics_queue) info_log("Using a dedicated transfer queue, family {}", vkcontext.device_props.transfer_index);
   }
 }
 
@@ -210,7 +275,8 @@ void Swapchain::init(GLFWwindow* window) {
     create_info.imageFormat = VK_FORMAT_B8G8R8A8_SRGB;
     create_info.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
     create_info.presentMode = vkcontext.device_props.present_mode;
-    create_info.imageExtent = { (u32) (width), (u32) (height) };
+    extent = { (u32) (width), (u32) (height) };
+    create_info.imageExtent = extent;
     create_info.minImageCount = NUM_FRAMES;
     create_info.imageArrayLayers = 1;
     create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -290,8 +356,8 @@ void Swapchain::init(GLFWwindow* window) {
   {
     VkFramebufferCreateInfo fb_info = { VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO };
     fb_info.renderPass = render_pass;
-    fb_info.width = 1920;
-    fb_info.height = 1080;
+    fb_info.width = extent.width;
+    fb_info.height = extent.height;
     fb_info.layers = 1;
 
     for (int i = 0; i < NUM_FRAMES; ++i) {
@@ -412,6 +478,18 @@ void VulkanContext::init_imgui(GLFWwindow* window) {
   info_log("Initilized ImGui");
 }
 
+void VulkanContext::init_sync() {
+  VkSemaphoreCreateInfo semaphore_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+  VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+  for (u32 i = 0; i < NUM_FRAMES; ++i) {
+    VK_CHECK(vkCreateSemaphore(vkcontext.device, &semaphore_info, nullptr, &vkcontext.frame_data[i].acquire_semaphore));
+    VK_CHECK(vkCreateSemaphore(vkcontext.device, &semaphore_info, nullptr, &vkcontext.frame_data[i].present_semaphore));
+    VK_CHECK(vkCreateFence(vkcontext.device, &fence_info, nullptr, &vkcontext.frame_data[i].render_fence));
+  }
+}
+
 void VulkanContext::InitContext(GLFWwindow* window) {
   VulkanContext::init_instance();
   #ifdef VALIDATION_LAYERS
@@ -423,26 +501,41 @@ void VulkanContext::InitContext(GLFWwindow* window) {
   VulkanContext::init_imgui(window);
   VulkanContext::init_desc_pools();
   VulkanContext::init_compiler();
+  ShaderCache::load_pipeline_cache();
+  VulkanContext::init_sync();
+}
 
-  VkSemaphoreCreateInfo semaphore_info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
-  VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-  for (u32 i = 0; i < NUM_FRAMES; ++i) {
-    VK_CHECK(vkCreateSemaphore(vkcontext.device, &semaphore_info, nullptr, &vkcontext.frame_data[i].acquire_semaphore));
-    VK_CHECK(vkCreateSemaphore(vkcontext.device, &semaphore_info, nullptr, &vkcontext.frame_data[i].present_semaphore));
-    VK_CHECK(vkCreateFence(vkcontext.device, &fence_info, nullptr, &vkcontext.frame_data[i].render_fence));
-  }
+void VulkanContext::InitHeadless() {
+  vkcontext.headless = true;
+  VulkanContext::init_instance();
+  #ifdef VALIDATION_LAYERS
+  VulkanContext::init_debug_utils();
+  #endif
+  VulkanContext::init_device();
+  VulkanContext::init_allocator();
+  VulkanContext::init_cmd_pools();
+  vkutil::init_utils();
+  VulkanContext::init_desc_pools();
+  VulkanContext::init_compiler();
+  ShaderCache::load_pipeline_cache();
+  VulkanContext::init_sync();
+  info_log("Initialized headless context");
 }
 
 const FrameData& VkContext::StartFrame() {
+  u32 next_index = frame_index;
   const FrameData& next_frame = frame_data[frame_index++];
   frame_index %= NUM_FRAMES;
 
   VK_CHECK(vkWaitForFences(vkcontext.device, 1, &next_frame.render_fence, VK_TRUE, UINT64_MAX));
   VK_CHECK(vkResetFences(vkcontext.device, 1, &next_frame.render_fence));
 
-  VK_CHECK(vkAcquireNextImageKHR(device, swapchain.swapchain, UINT64_MAX, next_frame.acquire_semaphore, VK_NULL_HANDLE, &swapchain.image_index));
+  if (headless) {
+    swapchain.image_index = next_index; // nothing to acquire, cycle through frame_data directly
+  } else {
+    VK_CHECK(vkAcquireNextImageKHR(device, swapchain.swapchain, UINT64_MAX, next_frame.acquire_semaphore, VK_NULL_HANDLE, &swapchain.image_index));
+  }
+  current_frame = swapchain.image_index;
   const FrameData& curr_frame = frame_data[swapchain.image_index];
   VK_CHECK(vkResetCommandBuffer(curr_frame.cmd_buff, 0));
   VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
@@ -455,16 +548,38 @@ void VkContext::EndFrame() {
   const FrameData& frameData = frame_data[swapchain.image_index];
   VK_CHECK(vkEndCommandBuffer(frameData.cmd_buff));
 
-  VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+  // the acquire semaphore is binary, its value is ignored. a pending upload adds a timeline wait
+  VkSemaphore wait_semaphores[2];
+  u64 wait_values[2] = { 0, 0 };
+  VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+  u32 wait_count = 0;
+  if (!headless) wait_semaphores[wait_count++] = frameData.acquire_semaphore;
+  vkutil::UploadWait upload;
+  if (vkutil::take_upload_wait(upload)) {
+    wait_semaphores[wait_count] = upload.semaphore;
+    wait_values[wait_count++] = upload.value;
+  }
+
+  VkTimelineSemaphoreSubmitInfo timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+  timeline_info.waitSemaphoreValueCount = wait_count;
+  timeline_info.pWaitSemaphoreValues = wait_values;
+
   VkSubmitInfo submit_info = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-  submit_info.waitSemaphoreCount = 1;
-  submit_info.pWaitSemaphores = &frameData.acquire_semaphore;
-  submit_info.pWaitDstStageMask = waitStages;
-  submit_info.signalSemaphoreCount = 1;
-  submit_info.pSignalSemaphores = &frameData.present_semaphore;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = wait_count;
+  submit_info.pWaitSemaphores = wait_semaphores;
+  submit_info.pWaitDstStageMask = wait_stages;
   submit_info.commandBufferCount = 1;
   submit_info.pCommandBuffers = &frameData.cmd_buff;
 
+  if (headless) {
+    VK_CHECK(vkQueueSubmit(graphics_queue, 1, &submit_info, frameData.render_fence));
+    return;
+  }
+
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &frameData.present_semaphore;
+
   VK_CHECK(vkQueueSubmit(graphics_queue, 1, &submit_info, frameData.render_fence));
 
   VkPresentInfoKHR present_info = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
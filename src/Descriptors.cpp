@@ -246,6 +246,14 @@ WriteDescSet DescSet::make_write_array(VkDescriptorImageInfo* image_info, u32 bi
   return empty_set;
 }
 
+WriteDescSet DescSet::make_write_frames(VkDescriptorBufferInfo* frame_infos, u32 binding) {
+  WriteDescSet write_set = make_write(frame_infos, binding);
+  for (u32 j = 0; j < NUM_FRAMES; ++j) {
+    write_set.writes[j].pBufferInfo = &frame_infos[j];
+  }
+  return write_set;
+}
+
 void DescSet::update_writes(WriteDescSet* writes, u32 count) {
   std::vector<VkWriteDescriptorSet> desc_writes(count*NUM_FRAMES);
   u32 write_count = 0;
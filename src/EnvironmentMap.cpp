@@ -0,0 +1,123 @@
+#include "EnvironmentMap.h"
+#include "Context.h"
+#include "CmdUtils.h"
+#include "ThreadPool.h"
+#include <stb_image/stb_image.h>
+#include <glm/gtc/constants.hpp>
+#include <chrono>
+
+EnvironmentMap::~EnvironmentMap() {
+  if (decoding.valid()) decoding.wait();
+}
+
+void EnvironmentMap::start(const std::string& env_file, float env_multiplier) {
+  file = env_file;
+  multiplier = env_multiplier;
+  if (!file.empty()) decoding = thread_pool.submit([this]() { return decode(); });
+}
+
+bool EnvironmentMap::decode() {
+  auto start = std::chrono::high_resolution_clock::now();
+  int w, h, channels;
+  float* data = stbi_loadf(file.c_str(), &w, &h, &channels, STBI_rgb_alpha);
+  if (!data) {
+    err_log("Failed to load environment map: {}", file);
+    return false;
+  }
+  width = (u32) w;
+  height = (u32) h;
+
+  pixels.resize((size_t) width * height * 4);
+  tables.resize(height + 1 + (size_t) height * (width + 1) + (size_t) height * width);
+  float* marginal = tables.data();
+  float* conditional = marginal + height + 1;
+  float* weights = conditional + (size_t) height * (width + 1);
+
+  // rows are independent, each converts its texels and builds its own cdf
+  std::vector<double> row_means(height);
+  thread_pool.parallel_for(height, [&](u32 y) {
+    float sin_theta = sinf((y + 0.5f) * glm::pi<float>() / height);
+    const float* src = data + (size_t) y * width * 4;
+    float* dst = pixels.data() + (size_t) y * width * 4;
+    float* row_weights = weights + (size_t) y * width;
+    float* cdf = conditional + (size_t) y * (width + 1);
+
+    double sum = 0;
+    for (u32 x = 0; x < width; ++x) {
+      const float* texel = src + x * 4;
+      memcpy(dst + x*4, texel, 4*sizeof(float));
+      float luminance = 0.2126f*texel[0] + 0.7152f*texel[1] + 0.0722f*texel[2];
+      row_weights[x] = std::max(luminance, 0.0f) * sin_theta;
+      sum += row_weights[x];
+    }
+
+    // a black row is never picked by the marginal, a uniform cdf keeps it well formed anyway
+    double running = 0;
+    cdf[0] = 0;
+    for (u32 x = 0; x < width; ++x) {
+      running += row_weights[x];
+      cdf[x + 1] = sum > 0 ? (float) (running / sum) : (float) (x + 1) / width;
+    }
+    cdf[width] = 1;
+    row_means[y] = sum / width;
+  });
+  stbi_image_free(data);
+
+  double total = 0;
+  for (double mean : row_means) total += mean;
+  double running = 0;
+  marginal[0] = 0;
+  for (u32 y = 0; y < height; ++y) {
+    running += row_means[y];
+    marginal[y + 1] = total > 0 ? (float) (running / total) : (float) (y + 1) / height;
+  }
+  marginal[height] = 1;
+  integral = (float) (total / height);
+
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+  info_log("Loaded environment map {} ({}x{}) in {:.1f}ms", file, width, height, elapsed.count());
+  return true;
+}
+
+u64 EnvironmentMap::upload() {
+  bool loaded = decoding.valid() && decoding.get();
+  if (!loaded) {
+    width = height = 0;
+    integral = 0;
+    pixels.assign(4, 0.0f);
+    tables.assign(1, 0.0f);
+  }
+
+  Header header { width, height, integral, multiplier };
+  std::vector<u8> buffer_data(sizeof(Header) + tables.size() * sizeof(float));
+  memcpy(buffer_data.data(), &header, sizeof(Header));
+  memcpy(buffer_data.data() + sizeof(Header), tables.data(), tables.size() * sizeof(float));
+
+  VkExtent3D extent = { std::max(width, 1u), std::max(height, 1u), 1 };
+  u64 upload = vkutil::upload_async([&](VkCommandBuffer cmd) {
+    radiance.create(VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, extent, 1, VK_FORMAT_R32G32B32A32_SFLOAT);
+    radiance.cmdTransitionLayout(cmd, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    vkutil::toImage(cmd, radiance.image, pixels.size() * sizeof(float), pixels.data(), extent);
+    radiance.cmdTransitionToShaderRead(cmd);
+    distribution.create(cmd, buffer_data.size(), buffer_data.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  });
+
+  // linear filtering of rgba32f is optional, nearest matches the piecewise constant pdf anyway
+  VkFormatProperties format_props;
+  vkGetPhysicalDeviceFormatProperties(vkcontext.phys_device, VK_FORMAT_R32G32B32A32_SFLOAT, &format_props);
+  if (!(format_props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)) {
+    vkDestroySampler(vkcontext.device, radiance.sampler, nullptr);
+    VkSamplerCreateInfo sampler_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    VK_CHECK(vkCreateSampler(vkcontext.device, &sampler_info, nullptr, &radiance.sampler));
+  }
+
+  // both were copied into staging memory while recording
+  pixels = {};
+  tables = {};
+  return upload;
+}
@@ -1,12 +1,17 @@
 #include "Context.h"
 #include "Image.h"
 #include "Buffer.h"
+#include "StagingRing.h"
+
+void AllocatedImage::create(VkImageUsageFlags image_usage, VkExtent3D _extent, u32 mipmap_count, VkFormat _format) {
+  format = _format;
+  extent = _extent;
+  mip_levels = mipmap_count;
 
-void AllocatedImage::create(VkImageUsageFlags image_usage, VkExtent3D extent, u32 mipmap_count) {
   VkImageCreateInfo image_info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
   image_info.flags = 0;
   image_info.imageType = VK_IMAGE_TYPE_2D;
-  image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_info.format = format;
   image_info.extent = extent;
   image_info.mipLevels = mipmap_count;
   image_info.arrayLayers = 1;
@@ -15,6 +20,7 @@ void AllocatedImage::create(VkImageUsageFlags image_usage, VkExtent3D extent, u3
   image_info.usage = image_usage;
   image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
   image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  share_with_transfer_queue(image_info);
 
   VmaAllocationCreateInfo alloc_info = {};
   alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
@@ -24,7 +30,7 @@ void AllocatedImage::create(VkImageUsageFlags image_usage, VkExtent3D extent, u3
   VkImageViewCreateInfo image_view_info = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
   image_view_info.image = image;
   image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-  image_view_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_view_info.format = format;
   image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
   image_view_info.subresourceRange.levelCount = mipmap_count;
   image_view_info.subresourceRange.baseArrayLayer = 0;
@@ -52,7 +58,7 @@ void AllocatedImage::create(VkImageUsageFlags image_usage, VkExtent3D extent, u3
   sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
   sampler_info.mipLodBias = 0.0f;
   sampler_info.minLod = 0.0f;
-  sampler_info.maxLod = 0.0f;
+  sampler_info.maxLod = (float) mipmap_count;
 
   VK_CHECK(vkCreateSampler(vkcontext.device, &sampler_info, nullptr, &sampler));
 }
@@ -121,17 +127,42 @@ void AllocatedImage::cmdTransitionLayout(VkCommandBuffer cmd_buff, VkImageLayout
   image_barrier.image = image;
   image_barrier.srcAccessMask = accessFlagsForImageLayout(old_layout);
   image_barrier.dstAccessMask = accessFlagsForImageLayout(new_layout);
-  image_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1, };
+  image_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mip_levels, 0, 1, };
   VkPipelineStageFlags src_stage = pipelineStageForLayout(old_layout);
   VkPipelineStageFlags dst_stage = pipelineStageForLayout(new_layout);
   vkCmdPipelineBarrier(cmd_buff, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
 }
 
+void AllocatedImage::cmdTransitionToShaderRead(VkCommandBuffer cmd_buff) {
+  // shader stages do not exist on a transfer queue, the semaphore the reader waits on makes the writes visible
+  VkImageMemoryBarrier image_barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+  image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  image_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  image_barrier.image = image;
+  image_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  image_barrier.dstAccessMask = 0;
+  image_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mip_levels, 0, 1, };
+  vkCmdPipelineBarrier(cmd_buff, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+}
 
 void AllocatedImage::cmdCopyImage(VkCommandBuffer cmd_buff, VkImage dst_image,VkImageLayout src_layout,VkImageLayout dst_layout, u32 copy_count, VkImageCopy* regions) {
   vkCmdCopyImage(cmd_buff, image, src_layout, dst_image, dst_layout, copy_count, regions);
 }
 
+void AllocatedImage::cmdCopyToBuffer(VkCommandBuffer cmd_buff, VkBuffer dst_buffer, VkImageLayout src_layout) {
+  VkBufferImageCopy cpy {};
+  cpy.bufferOffset = 0;
+  cpy.bufferRowLength = 0;
+  cpy.bufferImageHeight = 0;
+  cpy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  cpy.imageSubresource.mipLevel = 0;
+  cpy.imageSubresource.baseArrayLayer = 0;
+  cpy.imageSubresource.layerCount = 1;
+  cpy.imageExtent = extent;
+
+  vkCmdCopyImageToBuffer(cmd_buff, image, src_layout, dst_buffer, 1, &cpy);
+}
+
 namespace vkutil {
 
 void TransImageLayout(VkImage image, VkCommandBuffer cmd_buff, VkImageLayout old_layout, VkImageLayout new_layout) {
@@ -147,17 +178,13 @@ void TransImageLayout(VkImage image, VkCommandBuffer cmd_buff, VkImageLayout old
   vkCmdPipelineBarrier(cmd_buff, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
 }
 
-  void toImage(VkCommandBuffer cmd, VkImage image, VkDeviceSize offset, VkDeviceSize size, const void *data, VkExtent3D image_extent) {
+  void toImage(VkCommandBuffer cmd, VkImage image, VkDeviceSize size, const void *data, VkExtent3D image_extent) {
     if (!size || !image)
       return;
 
-    AllocatedBuffer staging;
-    staging.create(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-    void* mapping = staging.map();
-    memcpy(mapping, data, size);
-    staging.unmap();
+    StagingAlloc staging = vkstaging.stage(data, size);
     VkBufferImageCopy cpy {};
-    cpy.bufferOffset = offset;
+    cpy.bufferOffset = staging.offset;
     cpy.bufferRowLength = 0;
     cpy.bufferImageHeight = 0;
     cpy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -168,4 +195,37 @@ void TransImageLayout(VkImage image, VkCommandBuffer cmd_buff, VkImageLayout old
 
     vkCmdCopyBufferToImage(cmd, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cpy);
   }
+
+  VkDeviceSize mip_level_size(VkFormat format, u32 width, u32 height, u32 level) {
+    VkDeviceSize w = std::max(width >> level, 1u), h = std::max(height >> level, 1u);
+    switch (format) {
+      case VK_FORMAT_BC5_UNORM_BLOCK:
+      case VK_FORMAT_BC7_UNORM_BLOCK:
+	return ((w + 3) / 4) * ((h + 3) / 4) * 16;
+      default:
+	assert_log(format == VK_FORMAT_R8G8B8A8_UNORM, "mip_level_size(), unsupported format");
+	return w * h * 4;
+    }
+  }
+
+  void toImage(VkCommandBuffer cmd, VkImage image, const void *data, VkExtent3D image_extent, u32 mip_count, VkFormat format) {
+    if (!image || !mip_count)
+      return;
+
+    VkBufferImageCopy regions[16];
+    assert_log(mip_count <= COUNT_OF(regions), "toImage(), too many mip levels");
+    VkDeviceSize size = 0;
+    for (u32 level = 0; level < mip_count; ++level) {
+      regions[level] = {};
+      regions[level].bufferOffset = size;
+      regions[level].imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+      regions[level].imageExtent = { std::max(image_extent.width >> level, 1u), std::max(image_extent.height >> level, 1u), 1 };
+      size += mip_level_size(format, image_extent.width, image_extent.height, level);
+    }
+
+    // 16 covers the texel size of rgba8 and the block size of bc formats
+    StagingAlloc staging = vkstaging.stage(data, size, 16);
+    for (u32 level = 0; level < mip_count; ++level) regions[level].bufferOffset += staging.offset;
+    vkCmdCopyBufferToImage(cmd, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mip_count, regions);
+  }
 }
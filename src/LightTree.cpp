@@ -0,0 +1,132 @@
+#include "LightTree.h"
+#include "Scene.h"
+#include <algorithm>
+#include <glm/gtc/constants.hpp>
+
+// flat quads would make the ray box test degenerate
+static constexpr float BOUNDS_PADDING = 1e-4f;
+
+static LightNode light_bounds(const Light& light, u32 index) {
+  LightNode node {};
+  node.child = index;
+  node.leaf = 1;
+  const glm::vec3& emission = light.emission;
+  node.power = std::max(0.2126f*emission.x + 0.7152f*emission.y + 0.0722f*emission.z, 0.0f) * light.radius_area_type.y;
+  node.cos_theta_e = 0; // diffuse emitters, theta_e = pi/2
+
+  if (light.radius_area_type.z == 0) { // quad, emits on the side cross(u, v) points to
+    glm::vec3 corners[] = { light.pos, light.pos + light.u, light.pos + light.v, light.pos + light.u + light.v };
+    node.bounds_min = node.bounds_max = corners[0];
+    for (const glm::vec3& corner : corners) {
+      node.bounds_min = glm::min(node.bounds_min, corner);
+      node.bounds_max = glm::max(node.bounds_max, corner);
+    }
+    node.axis = glm::normalize(glm::cross(light.u, light.v));
+    node.cos_theta_o = 1;
+  } else { // sphere, emits in every direction
+    glm::vec3 radius(light.radius_area_type.x);
+    node.bounds_min = light.pos - radius;
+    node.bounds_max = light.pos + radius;
+    node.axis = glm::vec3(0, 0, 1);
+    node.cos_theta_o = -1;
+  }
+  node.bounds_min -= BOUNDS_PADDING;
+  node.bounds_max += BOUNDS_PADDING;
+  return node;
+}
+
+// smallest cone containing both, as in pbrt-v4's DirectionCone::Union
+static void merge_cones(glm::vec3& axis, float& cos_theta, const glm::vec3& other_axis, float other_cos_theta) {
+  float theta_a = acosf(glm::clamp(cos_theta, -1.0f, 1.0f));
+  float theta_b = acosf(glm::clamp(other_cos_theta, -1.0f, 1.0f));
+  float theta_d = acosf(glm::clamp(glm::dot(axis, other_axis), -1.0f, 1.0f));
+  if (std::min(theta_d + theta_b, glm::pi<float>()) <= theta_a) return;
+  if (std::min(theta_d + theta_a, glm::pi<float>()) <= theta_b) {
+    axis = other_axis;
+    cos_theta = other_cos_theta;
+    return;
+  }
+
+  float theta_o = (theta_a + theta_d + theta_b) / 2;
+  glm::vec3 rotation_axis = glm::cross(axis, other_axis);
+  if (theta_o >= glm::pi<float>() || glm::dot(rotation_axis, rotation_axis) < 1e-12f) {
+    cos_theta = -1;
+    return;
+  }
+  // rotate axis towards other_axis until the cone just covers both
+  float theta_r = theta_o - theta_a;
+  rotation_axis = glm::normalize(rotation_axis);
+  axis = axis*cosf(theta_r) + glm::cross(rotation_axis, axis)*sinf(theta_r) + rotation_axis*glm::dot(rotation_axis, axis)*(1 - cosf(theta_r));
+  axis = glm::normalize(axis);
+  cos_theta = cosf(theta_o);
+}
+
+static LightNode merge(const LightNode& a, const LightNode& b) {
+  LightNode node {};
+  node.bounds_min = glm::min(a.bounds_min, b.bounds_min);
+  node.bounds_max = glm::max(a.bounds_max, b.bounds_max);
+  node.power = a.power + b.power;
+  // lights without power never get picked, only their bounds matter for intersection
+  if (a.power <= 0 || b.power <= 0) {
+    const LightNode& lit = a.power > 0 ? a : b;
+    node.axis = lit.axis;
+    node.cos_theta_o = lit.cos_theta_o;
+    node.cos_theta_e = lit.cos_theta_e;
+    return node;
+  }
+  node.axis = a.axis;
+  node.cos_theta_o = a.cos_theta_o;
+  merge_cones(node.axis, node.cos_theta_o, b.axis, b.cos_theta_o);
+  node.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+  return node;
+}
+
+// splits at the centroid median along the widest axis, which keeps the depth at log2 of the light count
+static LightNode build_node(std::vector<LightNode>& nodes, std::vector<u32>& order, const std::vector<LightNode>& leaves, u32 begin, u32 end) {
+  u32 index = (u32) nodes.size();
+  nodes.emplace_back();
+  if (end - begin == 1) {
+    nodes[index] = leaves[order[begin]];
+    return nodes[index];
+  }
+
+  auto centroid = [&](u32 light) { return 0.5f*(leaves[light].bounds_min + leaves[light].bounds_max); };
+  glm::vec3 centroid_min = centroid(order[begin]), centroid_max = centroid_min;
+  for (u32 i = begin; i < end; ++i) {
+    centroid_min = glm::min(centroid_min, centroid(order[i]));
+    centroid_max = glm::max(centroid_max, centroid(order[i]));
+  }
+  glm::vec3 extent = centroid_max - centroid_min;
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+  u32 mid = (begin + end) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](u32 a, u32 b) { return centroid(a)[axis] < centroid(b)[axis]; });
+  LightNode first = build_node(nodes, order, leaves, begin, mid);
+  u32 second_index = (u32) nodes.size();
+  LightNode second = build_node(nodes, order, leaves, mid, end);
+
+  nodes[index] = merge(first, second);
+  nodes[index].child = second_index;
+  nodes[index].leaf = 0;
+  return nodes[index];
+}
+
+std::vector<LightNode> LightTree::build(const std::vector<Light>& lights) {
+  std::vector<LightNode> nodes;
+  // a zero power root keeps the buffer from being empty, the shaders check num_lights before walking it
+  if (lights.empty()) {
+    nodes.push_back(LightNode{});
+    nodes[0].leaf = 1;
+    return nodes;
+  }
+
+  std::vector<LightNode> leaves(lights.size());
+  std::vector<u32> order(lights.size());
+  for (u32 l = 0; l < lights.size(); ++l) {
+    leaves[l] = light_bounds(lights[l], l);
+    order[l] = l;
+  }
+  nodes.reserve(2*lights.size() - 1);
+  build_node(nodes, order, leaves, 0, (u32) lights.size());
+  return nodes;
+}
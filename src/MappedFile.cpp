@@ -0,0 +1,98 @@
+#include "MappedFile.h"
+#include <utility>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+  *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+  if (this != &other) {
+    close();
+    std::swap(data, other.data);
+    std::swap(size, other.size);
+#ifdef _WIN32
+    std::swap(file_handle, other.file_handle);
+    std::swap(mapping_handle, other.mapping_handle);
+#endif
+  }
+  return *this;
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string& filename) {
+  close();
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return false;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping) {
+    CloseHandle(file);
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+
+  file_handle = file;
+  mapping_handle = mapping;
+  data = (const u8*) view;
+  size = (size_t) file_size.QuadPart;
+  return true;
+}
+
+void MappedFile::close() {
+  if (data) UnmapViewOfFile(data);
+  if (mapping_handle) CloseHandle(mapping_handle);
+  if (file_handle) CloseHandle(file_handle);
+  data = nullptr;
+  size = 0;
+  file_handle = nullptr;
+  mapping_handle = nullptr;
+}
+#else
+bool MappedFile::open(const std::string& filename) {
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void* view = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // the mapping keeps its own reference
+  if (view == MAP_FAILED) return false;
+  madvise(view, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+  data = (const u8*) view;
+  size = (size_t) st.st_size;
+  return true;
+}
+
+void MappedFile::close() {
+  if (data) munmap((void*) data, size);
+  data = nullptr;
+  size = 0;
+}
+#endif
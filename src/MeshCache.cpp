@@ -0,0 +1,131 @@
+#include "MeshCache.h"
+#include "Scene.h"
+#include "Util.h"
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+struct PMeshHeader {
+  char magic[4];
+  u32 version;
+  u32 vert_size;
+  u32 path_length;
+  u64 source_size;
+  i64 source_mtime;
+  u64 vertex_count;
+  u64 index_count;
+  u64 vertex_offset;
+  u64 index_offset;
+};
+
+static constexpr char PMESH_MAGIC[4] = {'P', 'M', 'S', 'H'};
+
+struct SourceKey {
+  std::string path;
+  u64 size;
+  i64 mtime;
+};
+
+static bool source_key(const std::string& obj_file, SourceKey& key) {
+  std::error_code ec;
+  fs::path path = fs::absolute(obj_file, ec).lexically_normal();
+  if (ec) return false;
+  key.path = path.generic_string();
+  key.size = (u64) fs::file_size(path, ec);
+  if (ec) return false;
+  key.mtime = (i64) fs::last_write_time(path, ec).time_since_epoch().count();
+  return !ec;
+}
+
+static std::string cache_path(const SourceKey& key) {
+  if (MeshCache::cache_dir.empty()) return key.path + ".pmesh";
+  // a shared cache dir needs the full path in the name, two scenes can both have a Mesh001.obj
+  fs::path stem = fs::path(key.path).stem();
+  return (fs::path(MeshCache::cache_dir) / fmt::format("{}-{:016x}.pmesh", stem.string(), util::hash_bytes(util::FNV_OFFSET_BASIS, key.path.data(), key.path.size()))).string();
+}
+
+bool MeshCache::load(const std::string& obj_file, GeometryData& geometry) {
+  SourceKey key;
+  if (!source_key(obj_file, key)) return false;
+
+  MappedFile file;
+  if (!file.open(cache_path(key))) return false;
+  if (file.size < sizeof(PMeshHeader)) return false;
+
+  PMeshHeader header;
+  memcpy(&header, file.data, sizeof(header));
+  if (memcmp(header.magic, PMESH_MAGIC, sizeof(PMESH_MAGIC)) != 0 || header.version != VERSION || header.vert_size != sizeof(Vert)) {
+    info_log("Mesh cache version mismatch, reloading {}", obj_file);
+    return false;
+  }
+  if (header.source_size != key.size || header.source_mtime != key.mtime) return false; // obj changed since
+  if (sizeof(PMeshHeader) + header.path_length > file.size ||
+      key.path.compare(0, std::string::npos, (const char*) file.data + sizeof(PMeshHeader), header.path_length) != 0) {
+    return false;
+  }
+  if (header.vertex_offset + header.vertex_count*sizeof(Vert) > file.size ||
+      header.index_offset + header.index_count*sizeof(u32) > file.size) {
+    warn_log("Truncated mesh cache for {}", obj_file);
+    return false;
+  }
+
+  geometry.vertices.clear();
+  geometry.indices.clear();
+  geometry.vertex_view = { (const Vert*)(file.data + header.vertex_offset), (size_t) header.vertex_count };
+  geometry.index_view = { (const u32*)(file.data + header.index_offset), (size_t) header.index_count };
+  geometry.cache_file = std::move(file);
+  return true;
+}
+
+bool MeshCache::store(const std::string& obj_file, const GeometryData& geometry) {
+  SourceKey key;
+  if (!source_key(obj_file, key)) return false;
+
+  PMeshHeader header = {};
+  memcpy(header.magic, PMESH_MAGIC, sizeof(PMESH_MAGIC));
+  header.version = VERSION;
+  header.vert_size = sizeof(Vert);
+  header.path_length = (u32) key.path.size();
+  header.source_size = key.size;
+  header.source_mtime = key.mtime;
+  header.vertex_count = geometry.vertex_view.size();
+  header.index_count = geometry.index_view.size();
+  header.vertex_offset = util::align_up(sizeof(PMeshHeader) + header.path_length, 16);
+  header.index_offset = util::align_up(header.vertex_offset + header.vertex_count*sizeof(Vert), 16);
+
+  std::string filename = cache_path(key);
+  std::error_code ec;
+  if (!MeshCache::cache_dir.empty()) fs::create_directories(MeshCache::cache_dir, ec);
+
+  // write to a private temp file and rename, so a concurrent loader never maps a half written cache
+  std::string temp_name = fmt::format("{}.{:x}.tmp", filename, std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      warn_log("Could not write mesh cache, {}", filename);
+      return false;
+    }
+    const char padding[16] = {};
+    out.write((const char*) &header, sizeof(header));
+    out.write(key.path.data(), key.path.size());
+    out.write(padding, header.vertex_offset - (sizeof(header) + header.path_length));
+    out.write((const char*) geometry.vertex_view.data(), header.vertex_count*sizeof(Vert));
+    out.write(padding, header.index_offset - (header.vertex_offset + header.vertex_count*sizeof(Vert)));
+    out.write((const char*) geometry.index_view.data(), header.index_count*sizeof(u32));
+    if (!out) {
+      warn_log("Could not write mesh cache, {}", filename);
+      out.close();
+      fs::remove(temp_name, ec);
+      return false;
+    }
+  }
+  fs::rename(temp_name, filename, ec);
+  if (ec) {
+    warn_log("Could not write mesh cache, {}: {}", filename, ec.message());
+    fs::remove(temp_name, ec);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,80 @@
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "MeshWeld.h"
+#include "Scene.h"
+
+// open addressing table keyed on the obj (vertex, normal, texcoord) index triple.
+// sized up front for every face corner so it never rehashes, one probe sequence per corner
+struct WeldTable {
+  struct Slot {
+    int v, n, t;
+    u32 vert_id;
+  };
+  static constexpr u32 empty = UINT32_MAX;
+
+  std::vector<Slot> slots;
+  u32 mask;
+
+  WeldTable(size_t corner_count) {
+    size_t capacity = 16;
+    while (capacity < corner_count + corner_count/2) capacity <<= 1;
+    slots.resize(capacity, Slot{0, 0, 0, empty});
+    mask = (u32) capacity - 1;
+  }
+
+  static u32 hash(int v, int n, int t) {
+    u64 h = (u64)(u32)v * 0x9E3779B97F4A7C15ull;
+    h ^= (u64)(u32)n * 0xC2B2AE3D27D4EB4Full;
+    h ^= (u64)(u32)t * 0x165667B19E3779F9ull;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    return (u32)(h ^ (h >> 32));
+  }
+
+  // returns the slot for the triple, slot.vert_id == empty if it was not inserted yet
+  Slot& find(int v, int n, int t) {
+    for (u32 i = hash(v, n, t) & mask;; i = (i+1) & mask) {
+      Slot& slot = slots[i];
+      if (slot.vert_id == empty || (slot.v == v && slot.n == n && slot.t == t)) return slot;
+    }
+  }
+};
+
+void weld_vertices(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes, std::vector<Vert>& vertices, std::vector<u32>& indices) {
+  size_t corner_count = 0;
+  for (const auto& shape : shapes) corner_count += shape.mesh.num_face_vertices.size()*3;
+
+  WeldTable table(corner_count);
+  indices.reserve(indices.size() + corner_count);
+  vertices.reserve(vertices.size() + corner_count/4);
+
+  for (size_t s = 0; s < shapes.size(); ++s) {
+    const tinyobj::index_t* corners = shapes[s].mesh.indices.data();
+    size_t face_corners = shapes[s].mesh.num_face_vertices.size()*3; // LoadObj triangulates
+    for (size_t c = 0; c < face_corners; ++c) {
+      const tinyobj::index_t& idx = corners[c];
+      WeldTable::Slot& slot = table.find(idx.vertex_index, idx.normal_index, idx.texcoord_index);
+
+      if (slot.vert_id == WeldTable::empty) {
+	Vert vert{};
+	vert.pos.x = attrib.vertices[3 * idx.vertex_index + 0];
+	vert.pos.y = attrib.vertices[3 * idx.vertex_index + 1];
+	vert.pos.z = attrib.vertices[3 * idx.vertex_index + 2];
+
+	if (idx.normal_index >= 0) {
+	  vert.normal.x = attrib.normals[3 * idx.normal_index + 0];
+	  vert.normal.y = attrib.normals[3 * idx.normal_index + 1];
+	  vert.normal.z = attrib.normals[3 * idx.normal_index + 2];
+	}
+
+	if (idx.texcoord_index >= 0) {
+	  vert.uv.x = attrib.texcoords[2 * idx.texcoord_index + 0];
+	  vert.uv.y = 1-attrib.texcoords[2 * idx.texcoord_index + 1]; // flip y axis
+	}
+
+	slot = { idx.vertex_index, idx.normal_index, idx.texcoord_index, (u32) vertices.size() };
+	vertices.push_back(vert);
+      }
+      indices.push_back(slot.vert_id);
+    }
+  }
+}
@@ -1,4 +1,6 @@
 #include "RtProgram.h"
+#include "ShaderCache.h"
+#include "ThreadPool.h"
 #include <fstream>
 #include <iostream>
 
@@ -13,25 +15,50 @@ std::vector<char> readSPIRV(const char* filename) {
   return std::move(buffer);
 }
 
-bool createShaderModule(VkShaderModule& shader_module, const char *file, shaderc_shader_kind shader_kind) {
-  std::ifstream in(file, std::ios::in | std::ios::binary);
-  std::string glsl_src;
-  if (!in) {
-    err_log("Could not open shader file: {}", file);
-    return false;
+struct ShaderSource {
+  std::string file;
+  shaderc_shader_kind kind;
+  VkShaderModule module{VK_NULL_HANDLE};
+  std::vector<std::string> dependencies; // include closure, filled in by createShaderModules
+};
+
+static const shaderc_shader_kind stage_kinds[RtProgram::STAGE_COUNT] = { shaderc_raygen_shader, shaderc_miss_shader, shaderc_closesthit_shader };
+
+// compiles the stages concurrently on the thread pool, so the cost is roughly that of the slowest stage (raygen).
+// modules are only created once every stage compiled, on failure none are
+bool createShaderModules(std::span<ShaderSource> shaders) {
+  std::vector<std::vector<u32>> spv_srcs(shaders.size());
+  std::vector<u8> compiled(shaders.size());
+  thread_pool.parallel_for((u32) shaders.size(), [&](u32 i) {
+    compiled[i] = ShaderCache::compile(shaders[i].file.c_str(), shaders[i].kind, spv_srcs[i], &shaders[i].dependencies);
+  });
+  for (u8 result : compiled) {
+    if (!result) return false;
   }
-  glsl_src = std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-  auto result = vkcompiler.compiler.CompileGlslToSpv(glsl_src, shader_kind, file, vkcompiler.options);
-  if (result.GetCompilationStatus() == shaderc_compilation_status_success) {
-    std::vector<u32> spv_src  { result.cbegin(), result.cend() };
+
+  for (size_t i = 0; i < shaders.size(); ++i) {
     VkShaderModuleCreateInfo create_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
-    create_info.codeSize = (u32) (spv_src.size()*sizeof(u32));
-    create_info.pCode = spv_src.data();
-    VK_CHECK(vkCreateShaderModule(vkcontext.device, &create_info, nullptr, &shader_module));
-    return true;
+    create_info.codeSize = (u32) (spv_srcs[i].size()*sizeof(u32));
+    create_info.pCode = spv_srcs[i].data();
+    VK_CHECK(vkCreateShaderModule(vkcontext.device, &create_info, nullptr, &shaders[i].module));
   }
-  err_log("Shader compilation failed: {}, {}", file, result.GetErrorMessage());
-  return false;
+  return true;
+}
+
+// only touches its arguments and thread safe vulkan calls, so rebuilds can run it off the render thread
+static VkPipeline create_pipeline(const std::vector<VkPipelineShaderStageCreateInfo>& stages, const std::vector<VkRayTracingShaderGroupCreateInfoKHR>& groups, VkPipelineLayout layout) {
+  VkRayTracingPipelineCreateInfoKHR pipeline_info = { VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR };
+  pipeline_info.stageCount = (u32) stages.size();
+  pipeline_info.pStages = stages.data();
+  pipeline_info.groupCount = (u32) groups.size();
+  pipeline_info.pGroups = groups.data();
+  pipeline_info.maxPipelineRayRecursionDepth = vkcontext.device_props.rt_properties.maxRayRecursionDepth-1;
+  pipeline_info.layout = layout;
+  pipeline_info.pLibraryInfo = nullptr;
+
+  VkPipeline pipeline;
+  VK_CHECK(vkCreateRayTracingPipelinesKHR(vkcontext.device, VK_NULL_HANDLE, vkcontext.pipeline_cache, 1, &pipeline_info, nullptr, &pipeline));
+  return pipeline;
 }
 
 VkShaderModule createShaderModule(const char* filename) {
@@ -70,29 +97,31 @@ void RtProgram::init_shader_groups(const char* rgen, const char* rmiss, const ch
     hg.intersectionShader = VK_SHADER_UNUSED_KHR;
     shader_groups.emplace_back(hg);
 
-    bool result = true;
+    const char* files[STAGE_COUNT] = { rgen, rmiss, rchit };
+    ShaderSource shaders[STAGE_COUNT];
+    for (u32 i = 0; i < STAGE_COUNT; ++i) shaders[i] = { files[i], stage_kinds[i] };
+    bool result = createShaderModules(shaders);
+    for (u32 i = 0; i < STAGE_COUNT; ++i) {
+      stage_files[i] = files[i];
+      stage_dependencies[i] = std::move(shaders[i].dependencies);
+    }
+    watch_stage_files();
 
-    VkShaderModule raygenSM;
-    result = createShaderModule(raygenSM, rgen, shaderc_raygen_shader) && result;
     VkPipelineShaderStageCreateInfo raygenShaderStageInfo = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
     raygenShaderStageInfo.stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-    raygenShaderStageInfo.module = raygenSM;
+    raygenShaderStageInfo.module = shaders[0].module;
     raygenShaderStageInfo.pName = "main";
     shader_stages.emplace_back(raygenShaderStageInfo);
 
-    VkShaderModule missSM;
-    result = createShaderModule(missSM, rmiss, shaderc_miss_shader) && result;
     VkPipelineShaderStageCreateInfo missShaderStageInfo = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
     missShaderStageInfo.stage = VK_SHADER_STAGE_MISS_BIT_KHR;
-    missShaderStageInfo.module = missSM;
+    missShaderStageInfo.module = shaders[1].module;
     missShaderStageInfo.pName = "main";
     shader_stages.emplace_back(missShaderStageInfo);
 
-    VkShaderModule chSM;
-    result = createShaderModule(chSM, rchit, shaderc_closesthit_shader) && result;
     VkPipelineShaderStageCreateInfo chShaderStageInfo = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
     chShaderStageInfo.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
-    chShaderStageInfo.module = chSM;
+    chShaderStageInfo.module = shaders[2].module;
     chShaderStageInfo.pName = "main";
     shader_stages.emplace_back(chShaderStageInfo);
 
@@ -116,23 +145,11 @@ void RtProgram::init_shader_groups(const char* rgen, const char* rmiss, const ch
 
     VK_CHECK(vkCreatePipelineLayout(vkcontext.device, &pl_info, nullptr, &pl_layout));
 
-    VkPipelineLibraryCreateInfoKHR lib_info = { VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR };
-    lib_info.libraryCount = 0;
-    lib_info.pLibraries = nullptr;
- 
-    VkRayTracingPipelineCreateInfoKHR pipeline_info = { VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR };
-    pipeline_info.stageCount = (u32) shader_stages.size();
-    pipeline_info.pStages = shader_stages.data();
-    pipeline_info.groupCount = (u32) shader_groups.size();
-    pipeline_info.pGroups = shader_groups.data();
-    pipeline_info.maxPipelineRayRecursionDepth = vkcontext.device_props.rt_properties.maxRayRecursionDepth-1;
-    pipeline_info.layout = pl_layout;
-    pipeline_info.pLibraryInfo = nullptr;
-    VK_CHECK(vkCreateRayTracingPipelinesKHR(vkcontext.device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline));
+    pipeline = create_pipeline(shader_stages, shader_groups, pl_layout);
   }
 }
 
-void RtProgram::create_sbt() {
+static void build_sbt(VkPipeline pipeline, AllocatedBuffer& sbt_buffer, RtShader& rt_shaders) {
   u32 groupCount = rt_shaders.group_count;
   u32 groupHandleSize = vkcontext.device_props.rt_properties.shaderGroupHandleSize;
   u32 baseAlignment = vkcontext.device_props.rt_properties.shaderGroupBaseAlignment;
@@ -178,19 +195,51 @@ void RtProgram::create_sbt() {
   };
 }
 
+void RtProgram::create_sbt() {
+  build_sbt(pipeline, sbt_buffer, rt_shaders);
+}
+
 void RtProgram::bind(VkCommandBuffer cmd_buff) {
   vkCmdBindPipeline(cmd_buff, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
 }
 
-void RtProgram::render_to_swapchain(const FrameData& frame_data, AllocatedImage& output_image) {
-  vkCmdTraceRaysKHR(frame_data.cmd_buff, &rt_shaders.sbt_raygen, &rt_shaders.sbt_miss, &rt_shaders.sbt_rchit, &rt_shaders.sbt_call, 1920, 1080, 1);
-  vkCmdPipelineBarrier(frame_data.cmd_buff, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+std::vector<VkRect2D> RtProgram::make_tiles(VkExtent3D extent, glm::uvec2 tile_size) {
+  u32 tile_width = tile_size.x == 0 ? extent.width : std::min(tile_size.x, extent.width);
+  u32 tile_height = tile_size.y == 0 ? extent.height : std::min(tile_size.y, extent.height);
+
+  std::vector<VkRect2D> tiles;
+  for (u32 y = 0; y < extent.height; y += tile_height) {
+    for (u32 x = 0; x < extent.width; x += tile_width) {
+      tiles.push_back({ { (i32) x, (i32) y }, { std::min(tile_width, extent.width - x), std::min(tile_height, extent.height - y) } });
+    }
+  }
+  return tiles;
+}
+
+void RtProgram::trace(VkCommandBuffer cmd_buff, std::span<const VkRect2D> tiles) {
+  // tiles never overlap, so they only need a barrier against the next batch
+  for (const VkRect2D& tile : tiles) {
+    glm::uvec2 offset = { (u32) tile.offset.x, (u32) tile.offset.y };
+    vkCmdPushConstants(cmd_buff, pl_layout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, offsetof(RtConfig, tile_offset), sizeof(offset), &offset);
+    vkCmdTraceRaysKHR(cmd_buff, &rt_shaders.sbt_raygen, &rt_shaders.sbt_miss, &rt_shaders.sbt_rchit, &rt_shaders.sbt_call, tile.extent.width, tile.extent.height, 1);
+  }
+  // the next dispatch reads back progressive, the copy reads the output image
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmd_buff, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void RtProgram::render_to_swapchain(const FrameData& frame_data, AllocatedImage& output_image, std::span<const VkRect2D> tiles) {
+  trace(frame_data.cmd_buff, tiles);
+  // the window is sized to the render resolution, but the window system may have clamped it
+  VkExtent2D swapchain_extent = vkcontext.swapchain.extent;
   VkImageCopy swapchain_copy = {
     .srcSubresource { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
     .srcOffset { 0, 0, 0 },
     .dstSubresource { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
     .dstOffset { 0, 0, 0 },
-    .extent { 1920, 1080, 1 },
+    .extent { std::min(output_image.extent.width, swapchain_extent.width), std::min(output_image.extent.height, swapchain_extent.height), 1 },
   };
   VkImage& render_image = vkcontext.swapchain.images[vkcontext.swapchain.image_index].image;
   vkutil::TransImageLayout(render_image, frame_data.cmd_buff, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
@@ -200,45 +249,99 @@ void RtProgram::render_to_swapchain(const FrameData& frame_data, AllocatedImage&
   vkutil::TransImageLayout(render_image, frame_data.cmd_buff, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
 }
 
+void RtProgram::watch_stage_files() {
+  std::vector<std::string> files;
+  for (u32 i = 0; i < STAGE_COUNT; ++i) {
+    files.push_back(stage_files[i]);
+    files.insert(files.end(), stage_dependencies[i].begin(), stage_dependencies[i].end());
+  }
+  watcher.watch(files);
+}
+
 void RtProgram::update_shaders(const char *rgen, const char *rmiss, const char *rchit) {
-  bool success = true;
-  if (rgen != nullptr) {
-    VkShaderModule rgen_sm{};
-    bool result = createShaderModule(rgen_sm, rgen, shaderc_raygen_shader);
-    success = result && success;
-    if (result) shader_stages[0].module = rgen_sm;
+  const char* files[STAGE_COUNT] = { rgen, rmiss, rchit };
+  u32 stage_mask = 0;
+  for (u32 i = 0; i < STAGE_COUNT; ++i) {
+    if (files[i] == nullptr) continue;
+    stage_files[i] = files[i];
+    stage_mask |= 1u << i;
   }
+  start_rebuild(stage_mask);
+}
 
-  if (rmiss != nullptr) {
-    VkShaderModule rmiss_sm{};
-    bool result = createShaderModule(rmiss_sm, rmiss, shaderc_miss_shader);
-    success = result && success;
-    if (result) shader_stages[1].module = rmiss_sm;
+void RtProgram::start_rebuild(u32 stage_mask) {
+  if (stage_mask == 0) return;
+  if (rebuild.valid()) {
+    queued_stages |= stage_mask; // picked up by poll_reload once the running rebuild lands
+    return;
   }
 
-  if (rchit != nullptr) {
-    VkShaderModule rchit_sm{};
-    bool result = createShaderModule(rchit_sm, rchit, shaderc_closesthit_shader);
-    success = result && success;
-    if (result) shader_stages[2].module = rchit_sm;
+  // the job works on copies, the live pipeline keeps rendering until poll_reload() swaps the result in
+  PipelineRebuild job;
+  job.stages = shader_stages;
+  std::vector<ShaderSource> shaders;
+  for (u32 i = 0; i < STAGE_COUNT; ++i) {
+    if (!(stage_mask & (1u << i))) continue;
+    shaders.push_back({ stage_files[i], stage_kinds[i] });
+    job.replaced.push_back(i);
+  }
+  job.rt_shaders = rt_shaders;
+
+  rebuild = thread_pool.submit([job = std::move(job), shaders = std::move(shaders), groups = shader_groups, layout = pl_layout]() mutable {
+    job.success = createShaderModules(shaders);
+    if (!job.success) return std::move(job);
+
+    for (size_t i = 0; i < shaders.size(); ++i) {
+      job.stages[job.replaced[i]].module = shaders[i].module;
+      job.dependencies.push_back(std::move(shaders[i].dependencies));
+    }
+    job.pipeline = create_pipeline(job.stages, groups, layout);
+    build_sbt(job.pipeline, job.sbt_buffer, job.rt_shaders);
+    return std::move(job);
+  });
+}
+
+bool RtProgram::poll_reload() {
+  // a retired pipeline may still be referenced by the frames in flight when it was swapped out
+  for (size_t i = 0; i < retired.size();) {
+    if (--retired[i].frames_left > 0) {
+      ++i;
+      continue;
+    }
+    vkDestroyPipeline(vkcontext.device, retired[i].pipeline, nullptr);
+    retired[i].sbt_buffer.destroy();
+    retired[i] = retired.back();
+    retired.pop_back();
+  }
+
+  if (watcher.poll()) {
+    info_log("Shader sources changed, rebuilding in the background");
+    start_rebuild((1u << STAGE_COUNT) - 1);
+  }
+
+  if (!rebuild.valid() || rebuild.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+  PipelineRebuild result = rebuild.get();
+
+  if (result.success) {
+    retired.push_back({ pipeline, sbt_buffer, NUM_FRAMES + 1 });
+    for (size_t i = 0; i < result.replaced.size(); ++i) {
+      u32 stage = result.replaced[i];
+      // pipelines do not reference their modules once created, the old ones can go right away
+      vkDestroyShaderModule(vkcontext.device, shader_stages[stage].module, nullptr);
+      stage_dependencies[stage] = std::move(result.dependencies[i]);
+    }
+    shader_stages = std::move(result.stages);
+    pipeline = result.pipeline;
+    sbt_buffer = result.sbt_buffer;
+    rt_shaders = result.rt_shaders;
+    watch_stage_files();
+    info_log("Swapped in the rebuilt ray tracing pipeline");
+  } else {
+    err_log("Shader rebuild failed, keeping the current pipeline");
   }
-  if (!success) return;
-  VkPipelineLibraryCreateInfoKHR lib_info = { VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR };
-  lib_info.libraryCount = 0;
-  lib_info.pLibraries = nullptr;
- 
-  VkRayTracingPipelineCreateInfoKHR pipeline_info = { VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR };
-  pipeline_info.stageCount = (u32) shader_stages.size();
-  pipeline_info.pStages = shader_stages.data();
-  pipeline_info.groupCount = (u32) shader_groups.size();
-  pipeline_info.pGroups = shader_groups.data();
-  pipeline_info.maxPipelineRayRecursionDepth = vkcontext.device_props.rt_properties.maxRayRecursionDepth-1;
-  pipeline_info.layout = pl_layout;
-  pipeline_info.pLibraryInfo = nullptr;
 
-  VK_CHECK(vkWaitForFences(vkcontext.device, 1, &vkcontext.frame_data[vkcontext.swapchain.image_index].render_fence, VK_TRUE, UINT64_MAX));
-  vkDestroyPipeline(vkcontext.device, pipeline, nullptr);
-  VK_CHECK(vkCreateRayTracingPipelinesKHR(vkcontext.device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline));
-  create_sbt();
-  info_log("compiled shaders...");
+  u32 queued = queued_stages;
+  queued_stages = 0;
+  start_rebuild(queued);
+  return result.success;
 }
@@ -1,12 +1,24 @@
-#define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image/stb_image.h>
 
 #include "Scene.h"
 #include "CmdUtils.h"
+#include "ThreadPool.h"
+#include "StagingRing.h"
+#include "MeshCache.h"
+#include "MeshWeld.h"
+#include "AccelCache.h"
+#include "LightTree.h"
+#include "SceneParser.h"
+#include <chrono>
 
 void GeometryData::load_obj(const std::string& filename) {
+  if (MeshCache::load(filename, *this)) {
+    info_log("Loaded cached model, {}", filename);
+    return;
+  }
+
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
@@ -22,66 +34,44 @@ void GeometryData::load_obj(const std::string& filename) {
   if (!warn.empty()) { warn_log(filename + ", " + warn); }
   assert_log(err.empty(), filename + ", " + err);
 
-  std::unordered_map<Vert, u32> unique_vertices{};
-  for (size_t s = 0; s < shapes.size(); ++s) {
-    size_t index_offset = 0;
-    for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); ++f) {
-      size_t fv = 3;
-      for (size_t v = 0; v < fv; ++v) {
-	tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-
-	tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
-	tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
-	tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
-
-	tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-	tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-	tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-
-	tinyobj::real_t tx = 0;
-	tinyobj::real_t ty = 0;
-        if (!attrib.texcoords.empty()) {
-	  tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-	  ty = 1-attrib.texcoords[2 * idx.texcoord_index + 1]; // flip y axis
-        }
-
-        Vert vert{};
-        vert.pos.x = vx;
-	vert.pos.y = vy;
-	vert.pos.z = vz;
-
-	vert.normal.x = nx;
-	vert.normal.y = ny;
-	vert.normal.z = nz;
-
-        vert.uv.x = tx;
-	vert.uv.y = ty;
-
-        if (unique_vertices.count(vert) == 0) {
-          unique_vertices[vert] = static_cast<u32>(vertices.size());
-          vertices.push_back(vert);
-        }
-	indices.push_back(unique_vertices[vert]);
-      }
-      index_offset += fv;
-    }
-  }
+  weld_vertices(attrib, shapes, vertices, indices);
+  vertex_view = vertices;
+  index_view = indices;
+  MeshCache::store(filename, *this);
 }
 
+// only registers the mesh, the obj files are loaded together by load_meshes() once the scene is parsed
 u32 Scene::add_mesh(const std::string &filename) {
   if(loaded_geometries.find(filename) != loaded_geometries.end()) return loaded_geometries[filename];
 
-  geometries.emplace_back();
-  geometries.back().load_obj(filename);
-  loaded_geometries[filename] = (u32) geometries.size() - 1;
+  mesh_files.emplace_back(filename);
+  loaded_geometries[filename] = (u32) mesh_files.size() - 1;
+
+  return (u32) mesh_files.size() - 1;
+}
+
+void Scene::load_meshes() {
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // ids were handed out in scene order by add_mesh, every worker writes only its own slot
+  geometries.resize(mesh_files.size());
+  thread_pool.parallel_for((u32) mesh_files.size(), [&](u32 m) {
+    geometries[m].load_obj(mesh_files[m]);
+  });
 
-  return (u32) geometries.size() - 1;
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+  info_log("Loaded {} meshes in {:.1f}ms", mesh_files.size(), elapsed.count());
 }
 
-u32 Scene::add_texture(const std::string &filename) {
-  if(loaded_textures.find(filename) != loaded_textures.end()) return loaded_textures[filename];
+u32 Scene::add_texture(const std::string &filename, TextureKind kind) {
+  if(loaded_textures.find(filename) != loaded_textures.end()) {
+    u32 id = loaded_textures[filename];
+    if (texture_kinds[id] != kind) texture_kinds[id] = TextureKind::color; // bc7 keeps every channel
+    return id;
+  }
 
   textures.emplace_back(filename);
+  texture_kinds.push_back(kind);
   loaded_textures[filename] = (u32) textures.size() - 1;
   return (u32) textures.size() - 1;
 }
@@ -94,214 +84,376 @@ u32 Scene::add_material(const Material& mat, const std::string &filename) {
   return (u32) materials.size() - 1;
 }
 
-bool Scene::Load_Scene(std::string &filename) {
-  const u32 max_length = 2048;
-  FILE* file = fopen(filename.c_str(), "r");
-
-  if (!file) {
-    err_log("Could not load scene file, {}", filename);
-    return false;
+enum class KeyResult { ok, unknown, invalid };
+
+// vose's alias method, picking a light in proportion to its power takes one table lookup in the shader
+static std::vector<LightAlias> build_light_alias_table(const std::vector<Light>& lights) {
+  u32 count = (u32) lights.size();
+  // one entry the shader never reads without lights, so the buffer is never empty
+  if (count == 0) return { LightAlias{ 1.0f, 0, 1.0f } };
+  std::vector<LightAlias> table(count);
+  std::vector<double> scaled(count);
+  double total = 0;
+  for (u32 l = 0; l < count; ++l) {
+    const glm::vec3& emission = lights[l].emission;
+    double luminance = 0.2126*emission.x + 0.7152*emission.y + 0.0722*emission.z;
+    scaled[l] = std::max(luminance, 0.0) * lights[l].radius_area_type.y;
+    total += scaled[l];
   }
-  info_log("Loading Scene... {}", filename);
-
-  std::string path = filename.substr(0, filename.find_last_of("/\\")) + "/";
-  char line[max_length];
-
-  bool camera_added= false;
-  while (fgets(line, max_length, file)) {
-    if(line[0] == '#' || line[0] == '\n') continue;
-
-    char name[max_length] = {0};
-
-    // material
-    if (sscanf(line, " material %s", name) == 1) {
-      Material mat;
-      char albedo_tex[100] = "None";
-      char metallic_roughness_tex[100] = "None";
-      char normal_tex[100] = "None";
-
-      while (fgets(line, max_length, file)) {
-        if (strchr(line, '}')) break;
-
-        sscanf(line, " name %s", name);
-        sscanf(line, " color %f %f %f", &mat.albedo.x, &mat.albedo.y,
-	       &mat.albedo.z);
-        sscanf(line, " emission %f %f %f", &mat.emission.x, &mat.emission.y,
-	       &mat.emission.z);
-        sscanf(line, " materialType %f", &mat.albedo.w);
-        sscanf(line, " metallic %f", &mat.metallic);
-        sscanf(line, " roughness %f", &mat.roughness);
-        sscanf(line, " ior %f", &mat.ior);
-        // scanf_s(line, " transmittance %f", &mat.transmittance);
-        
-        sscanf(line, " albedoTexture %s", albedo_tex);
-        sscanf(line, " metallicRoughness %s", metallic_roughness_tex);
-        sscanf(line, " normalTexture %s", normal_tex);
-      }
-
-      if (strcmp(albedo_tex, "None") != 0)
-        mat.tex_ids.x = (float) add_texture(path + albedo_tex);
-
-      if (strcmp(metallic_roughness_tex, "None") != 0)
-        mat.tex_ids.y = (float) add_texture(path + metallic_roughness_tex);
 
-      if (strcmp(normal_tex, "None") != 0)
-        mat.tex_ids.z = (float) add_texture(path + normal_tex);
-
-      add_material(mat, name);
+  std::vector<u32> small, large;
+  for (u32 l = 0; l < count; ++l) {
+    // lights without power fall back to uniform selection
+    table[l].pmf = total > 0 ? (float) (scaled[l] / total) : 1.0f / count;
+    scaled[l] = total > 0 ? scaled[l] * count / total : 1.0;
+    (scaled[l] < 1.0 ? small : large).push_back(l);
+  }
+  while (!small.empty() && !large.empty()) {
+    u32 s = small.back(), l = large.back();
+    small.pop_back();
+    table[s].probability = (float) scaled[s];
+    table[s].alias = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
     }
+  }
+  // whatever is left is 1 up to rounding
+  for (u32 l : large) table[l].probability = 1.0f, table[l].alias = l;
+  for (u32 s : small) table[s].probability = 1.0f, table[s].alias = s;
+  return table;
+}
 
-    // mesh
-    if (strstr(line, "mesh")) {
-      std::string filename;
-      glm::vec3 pos{0,0,0};
-      glm::vec3 scale{1,1,1};
-
-      u32 mat_id = 0;
-      char mesh_name[200]{"None"};
-
-      while (fgets(line, max_length, file)) {
-        if(strchr(line, '}')) break;
+static KeyResult valid(bool parsed) {
+  return parsed ? KeyResult::ok : KeyResult::invalid;
+}
 
-	char file[2048];
-	char mat_name[100];
+// walks the lines of a { } block and hands every key to parse_key, which reads the values it needs
+template <typename F>
+static bool parse_block(SceneTokenizer& tok, const std::string& filename, F&& parse_key) {
+  std::string_view open = tok.word();
+  if (open.empty() && tok.next_line()) open = tok.word();
+  if (open != "{") {
+    err_log("{}:{}: expected '{{' but found '{}'", filename, tok.line, open);
+    return false;
+  }
 
-	sscanf(line, " name %[^\t\n]s", mesh_name);
+  bool same_line = !tok.at_line_end();
+  while (same_line || tok.next_line()) {
+    same_line = false;
+    std::string_view key = tok.word();
+    if (key == "}") return true;
+
+    switch (parse_key(key)) {
+      case KeyResult::unknown:
+	warn_log("{}:{}: unknown key '{}'", filename, tok.line, key);
+	continue;
+      case KeyResult::invalid:
+	err_log("{}:{}: invalid value for '{}'", filename, tok.line, key);
+	return false;
+      case KeyResult::ok:
+	break;
+    }
 
-        if (sscanf(line, " file %s", file) == 1) {
-	  filename = path + file;
-        }
+    std::string_view trailing = tok.word();
+    if (trailing == "}") return true;
+    if (!trailing.empty()) warn_log("{}:{}: ignoring '{}' after '{}'", filename, tok.line, trailing, key);
+  }
+  err_log("{}: block is missing its closing '}}'", filename);
+  return false;
+}
 
-        if (sscanf(line, " material %s", mat_name) == 1) {
-          if (loaded_materials.find(mat_name) != loaded_materials.end()) {
-	    mat_id = loaded_materials[mat_name];
-          } else {
-            warn_log("Could not find material {}", mat_name);
-          }
-        }
+bool Scene::Load_Scene(std::string &filename) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    err_log("Could not load scene file, {}", filename);
+    return false;
+  }
+  info_log("Loading Scene... {}", filename);
 
-	sscanf(line, " position %f %f %f", &pos.x, &pos.y, &pos.z);
-	sscanf(line, " scale %f %f %f", &scale.x, &scale.y, &scale.z);
-	// TODO: take rotation here
+  size_t dir_end = filename.find_last_of("/\\");
+  std::string path = dir_end == std::string::npos ? "" : filename.substr(0, dir_end + 1);
+  SceneTokenizer tok((const char*) file.data, (const char*) file.data + file.size);
+
+  // the camera is created once the whole file is read, its aspect comes from the Renderer block
+  glm::vec3 cam_pos{0,0,10};
+  glm::vec3 cam_look_at{0,0,-10};
+  float cam_fov = 45;
+  float cam_aperture = 0, cam_focal_dist = 1;
+
+  while (tok.next_line()) {
+    std::string_view block = tok.word();
+    bool parsed = true;
+
+    switch (key_hash(block)) {
+      case key_hash("material"): {
+	Material mat;
+	std::string name(tok.word());
+	std::string_view albedo_tex, metallic_roughness_tex, normal_tex;
+
+	parsed = parse_block(tok, filename, [&](std::string_view key) {
+	  switch (key_hash(key)) {
+	    case key_hash("name"): name = tok.rest(); return valid(!name.empty());
+	    case key_hash("color"): {
+	      glm::vec3 color;
+	      if (!tok.read(color)) return KeyResult::invalid;
+	      mat.albedo = glm::vec4(color, mat.albedo.w);
+	      return KeyResult::ok;
+	    }
+	    case key_hash("emission"): return valid(tok.read(mat.emission));
+	    case key_hash("materialType"): return valid(tok.read(mat.albedo.w));
+	    case key_hash("metallic"): return valid(tok.read(mat.metallic));
+	    case key_hash("roughness"): return valid(tok.read(mat.roughness));
+	    case key_hash("ior"): return valid(tok.read(mat.ior));
+	    case key_hash("albedoTexture"): albedo_tex = tok.rest(); return valid(!albedo_tex.empty());
+	    case key_hash("metallicRoughness"):
+	    case key_hash("metallicRoughnessTexture"): metallic_roughness_tex = tok.rest(); return valid(!metallic_roughness_tex.empty());
+	    case key_hash("normalTexture"): normal_tex = tok.rest(); return valid(!normal_tex.empty());
+	    default: return KeyResult::unknown;
+	  }
+	});
+
+	if (!albedo_tex.empty() && albedo_tex != "None")
+	  mat.tex_ids.x = (float) add_texture(path + std::string(albedo_tex), TextureKind::color);
+
+	if (!metallic_roughness_tex.empty() && metallic_roughness_tex != "None")
+	  mat.tex_ids.y = (float) add_texture(path + std::string(metallic_roughness_tex), TextureKind::two_channel);
+
+	if (!normal_tex.empty() && normal_tex != "None")
+	  mat.tex_ids.z = (float) add_texture(path + std::string(normal_tex), TextureKind::two_channel);
+
+	add_material(mat, name);
+	break;
       }
 
-      if (!filename.empty()) {
-	u32 mesh_id = add_mesh(filename);
-	glm::vec3 axis{1,1,1};
-	scene_geometry.emplace_back(pos, axis, 0, scale, mesh_id, mat_id);
+      case key_hash("mesh"): {
+	std::string mesh_file;
+	glm::vec3 pos{0,0,0};
+	glm::vec3 scale{1,1,1};
+	u32 mat_id = 0;
+
+	parsed = parse_block(tok, filename, [&](std::string_view key) {
+	  switch (key_hash(key)) {
+	    case key_hash("name"): tok.rest(); return KeyResult::ok;
+	    case key_hash("file"): mesh_file = tok.rest(); return valid(!mesh_file.empty());
+	    case key_hash("material"): {
+	      std::string mat_name(tok.word());
+	      auto mat = loaded_materials.find(mat_name);
+	      if (mat != loaded_materials.end()) {
+		mat_id = mat->second;
+	      } else {
+		warn_log("{}:{}: could not find material {}", filename, tok.line, mat_name);
+	      }
+	      return KeyResult::ok;
+	    }
+	    case key_hash("position"): return valid(tok.read(pos));
+	    case key_hash("scale"): return valid(tok.read(scale));
+	    // TODO: take rotation here
+	    default: return KeyResult::unknown;
+	  }
+	});
+
+	if (parsed && !mesh_file.empty()) {
+	  u32 mesh_id = add_mesh(path + mesh_file);
+	  glm::vec3 axis{1,1,1};
+	  scene_geometry.emplace_back(pos, axis, 0, scale, mesh_id, mat_id);
+	}
+	break;
       }
-    }
-
-    // light
-    if (strstr(line, "light")) {
-      Light light;
-      char light_type[20] = "None";
-      glm::vec3 v1;
-      glm::vec3 v2;
-
-      while (fgets(line, max_length, file)) {
-        if (strchr(line, '}')) break;
 
-	sscanf(line, " position %f %f %f", &light.pos.x, &light.pos.y, &light.pos.z);
-	sscanf(line, " emission %f %f %f", &light.emission.x, &light.emission.y, &light.emission.z);
-
-	sscanf(line, " radius %f", &light.radius_area_type.x);
-	sscanf(line, " v1 %f %f %f", &v1.x, &v1.y, &v1.z);
-	sscanf(line, " v2 %f %f %f", &v2.x, &v2.y, &v2.z);
-	sscanf(line, " type %s", &light_type);
+      case key_hash("light"): {
+	Light light{};
+	std::string_view light_type = "None";
+	glm::vec3 v1{0}, v2{0};
+
+	parsed = parse_block(tok, filename, [&](std::string_view key) {
+	  switch (key_hash(key)) {
+	    case key_hash("position"): return valid(tok.read(light.pos));
+	    case key_hash("emission"): return valid(tok.read(light.emission));
+	    case key_hash("radius"): return valid(tok.read(light.radius_area_type.x));
+	    case key_hash("v1"): return valid(tok.read(v1));
+	    case key_hash("v2"): return valid(tok.read(v2));
+	    case key_hash("type"): light_type = tok.word(); return valid(!light_type.empty());
+	    default: return KeyResult::unknown;
+	  }
+	});
+
+	if (light_type == "Quad") {
+	  light.radius_area_type.z  = 0; // type 0 = quad
+	  light.u = v1 - light.pos;
+	  light.v = v2 - light.pos;
+	  light.radius_area_type.y = glm::length(glm::cross(light.u, light.v));
+	} else if (light_type == "Sphere") {
+	  light.radius_area_type.z = 1; // type 1 = sphere
+	  light.radius_area_type.y = 4.0f * 3.14159265f * light.radius_area_type.x * light.radius_area_type.x;
+	} else {
+	  warn_log("{}:{}: unknown light type, {}", filename, tok.line, light_type);
+	}
+	lights.push_back(light);
+	break;
       }
 
-      if (strcmp(light_type, "Quad") == 0) {
-	light.radius_area_type.z  = 0; // type 0 = quad
-	light.u = v1 - light.pos;
-	light.v = v2 - light.pos;
-	light.radius_area_type.y = glm::length(glm::cross(light.u, light.v));
-      } else if (strcmp(light_type, "Sphere") == 0) {
-	light.radius_area_type.z = 1; // type 1 = sphere
-	light.radius_area_type.y = 4.0f * 3.14159265f * light.radius_area_type.x;
-      } else {
-	warn_log("Unknown light type, {}", light_type);
+      case key_hash("Camera"): {
+	parsed = parse_block(tok, filename, [&](std::string_view key) {
+	  switch (key_hash(key)) {
+	    case key_hash("position"): return valid(tok.read(cam_pos));
+	    case key_hash("lookAt"): return valid(tok.read(cam_look_at));
+	    case key_hash("aperture"): return valid(tok.read(cam_aperture));
+	    case key_hash("focaldist"): return valid(tok.read(cam_focal_dist));
+	    case key_hash("fov"): return valid(tok.read(cam_fov));
+	    default: return KeyResult::unknown;
+	  }
+	});
+	break;
       }
-      lights.push_back(light);
-    }
-
-    if (strstr(line, "Camera")) {
-      glm::vec3 pos;
-      glm::vec3 look_at;
-      float fov;
-      float aperture = 0, focal_dist = 1;
 
-      while (fgets(line, max_length, file)) {
-        if(strchr(line, '}')) break;
+      case key_hash("Renderer"): {
+	parsed = parse_block(tok, filename, [&](std::string_view key) {
+	  switch (key_hash(key)) {
+	    case key_hash("resolution"):
+	      return valid(tok.read(settings.resolution.x) && tok.read(settings.resolution.y) &&
+			   settings.resolution.x > 0 && settings.resolution.y > 0);
+	    case key_hash("maxDepth"): return valid(tok.read(settings.max_depth));
+	    case key_hash("tileWidth"): return valid(tok.read(settings.tile_size.x));
+	    case key_hash("tileHeight"): return valid(tok.read(settings.tile_size.y));
+	    case key_hash("envMap"): {
+	      std::string_view env_map = tok.rest();
+	      if (!env_map.empty() && env_map != "None") settings.env_map = path + std::string(env_map);
+	      return KeyResult::ok;
+	    }
+	    case key_hash("hdrMultiplier"): return valid(tok.read(settings.hdr_multiplier));
+	    default: return KeyResult::unknown;
+	  }
+	});
+	break;
+      }
 
-	sscanf(line, " position %f %f %f", &pos.x, &pos.y, &pos.z);
-	sscanf(line, " lookAt %f %f %f", &look_at.x, &look_at.y, &look_at.z);
-	sscanf(line, " aperture %f ", &aperture);
-	sscanf(line, " focaldist %f", &focal_dist);
-	sscanf(line, " fov %f", &fov);
+      case key_hash("{"): {
+	// header was commented out (e.g. "#mesh"), so skip the whole block
+	parsed = false;
+	while (!parsed && tok.next_line()) parsed = tok.word() == "}";
+	if (!parsed) err_log("{}: block is missing its closing '}}'", filename);
+	break;
       }
 
-      camera = new Camera(pos, look_at, fov);
-      camera_added = true;
-    }
-    if (!camera_added) {
-      camera = new Camera(glm::vec3(0.0f, 0.0f, 10.0f), glm::vec3(0.0f, 0.0f, -10.0f), 45.0f);
+      default:
+	err_log("{}:{}: unknown block '{}'", filename, tok.line, block);
+	parsed = false;
+	break;
     }
-    // TODO: add camera and renderer settings
+
+    if (!parsed) return false;
   }
+
+  camera = new Camera(cam_pos, cam_look_at, cam_fov, settings.resolution);
+  info_log("Render settings: {}x{}, max depth {}, tile {}x{}", settings.resolution.x, settings.resolution.y,
+	   settings.max_depth, settings.tile_size.x, settings.tile_size.y);
+
+  environment.start(settings.env_map, settings.hdr_multiplier);
+  // textures decode in the background while the meshes load and the blases build. every queued texture
+  // holds its decoded pixels until it is uploaded, so only a few more than there are workers
+  texture_loader.start(textures, texture_kinds, thread_pool.size() + 2, true);
+  load_meshes();
   return true;
 }
 
 bool Scene::Build_Structures() {
-  vkutil::immediate_submit([&](VkCommandBuffer buffer) {
-    // stage scene desc. data
-    size_t desc_size = scene_geometry.size()*sizeof(SceneGeometry);
-    scene_buffers.scene_buffer.create(buffer, desc_size, scene_geometry.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  camera->ubo.create(sizeof(CameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+
+  // pack every mesh into one vertex and one index buffer
+  size_t vertex_count = 0, index_count = 0;
+  for (GeometryData& geometry : geometries) {
+    geometry.vertex_offset = (u32) vertex_count;
+    geometry.index_offset = (u32) index_count;
+    vertex_count += geometry.vertex_view.size();
+    index_count += geometry.index_view.size();
+  }
+  for (SceneGeometry& geometry : scene_geometry) {
+    geometry.vertex_offset = geometries[geometry.vert_id].vertex_offset;
+    geometry.index_offset = geometries[geometry.vert_id].index_offset;
+  }
+  if (vertex_count > UINT32_MAX || index_count > UINT32_MAX) {
+    err_log("Scene has too much geometry for 32 bit offsets, {} vertices and {} indices", vertex_count, index_count);
+    return false;
+  }
 
+  // scene desc. data is host visible and frame buffered so instances can move while earlier frames are in flight.
+  // 256 is the largest minStorageBufferOffsetAlignment a device may report
+  size_t desc_size = scene_geometry.size()*sizeof(SceneGeometry);
+  scene_buffers.scene_slice_size = (desc_size + 255) & ~(VkDeviceSize) 255;
+  scene_buffers.scene_buffer.create(NUM_FRAMES*scene_buffers.scene_slice_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+  scene_buffers.scene_data = (u8*) scene_buffers.scene_buffer.map();
+  for (u32 f = 0; f < NUM_FRAMES; ++f) {
+    memcpy(scene_buffers.scene_data + f*scene_buffers.scene_slice_size, scene_geometry.data(), desc_size);
+  }
+  vmaFlushAllocation(vkallocator, scene_buffers.scene_buffer.allocation, 0, VK_WHOLE_SIZE);
+
+  // uploads go to the transfer queue, the blas builds only wait for the geometry
+  u64 geometry_upload = vkutil::upload_async([&](VkCommandBuffer buffer) {
     // stage materials data
     size_t mats_size = materials.size()*sizeof(Material);
     scene_buffers.mat_buffer.create(buffer, mats_size, materials.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
-    // stage lights data
-    size_t lights_size = lights.size()*sizeof(Light);
-    scene_buffers.light_buffer.create(buffer, lights_size, lights.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-
-    // stage vertex and index buffers
-    scene_buffers.vbos.resize(geometries.size());
-    scene_buffers.ibos.resize(geometries.size());
-    for (size_t g = 0; g < geometries.size(); ++g) {
-      scene_buffers.vbos[g].create(buffer, (geometries[g].vertices.size() * sizeof(Vert)), geometries[g].vertices.data(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-      scene_buffers.ibos[g].create(buffer, (geometries[g].indices.size() * sizeof(u32)), geometries[g].indices.data(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-    }
-
-    // stage images
-    scene_buffers.textures.resize(textures.size());
-    for (u32 t = 0; t < textures.size(); ++t) {
-      const char* filename = textures[t].c_str();
-      AllocatedImage& texture = scene_buffers.textures[t];
-    
-      int width, height, channels;
-      stbi_uc* pixels = stbi_load(filename, &width, &height, &channels, STBI_rgb_alpha);
-      stbi_set_flip_vertically_on_load(false);
-      if (!pixels) {
-	err_log("Failed to load image: {}", filename);
-      } else {
-        info_log("Loading texture, {}", filename);
-        texture.create(VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, { (u32)width, (u32)height, 1});
-	texture.cmdTransitionLayout(buffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        vkutil::toImage(buffer, texture.image, 0, width * height * 4, pixels, {(u32)width, (u32)height, 1});
-	texture.cmdTransitionLayout(buffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-      }
-      stbi_image_free(pixels);
-    }
+    // stage lights data. scenes lit only by the environment have no lights, the shaders skip light
+    // sampling then but binding 5 still needs a buffer, vma rejects a size of 0
+    static const Light no_light {};
+    size_t lights_size = std::max<size_t>(lights.size(), 1)*sizeof(Light);
+    scene_buffers.light_buffer.create(buffer, lights_size, lights.empty() ? &no_light : lights.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    std::vector<LightAlias> light_aliases = build_light_alias_table(lights);
+    scene_buffers.light_alias_buffer.create(buffer, light_aliases.size()*sizeof(LightAlias), light_aliases.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    std::vector<LightNode> light_nodes = LightTree::build(lights);
+    scene_buffers.light_tree_buffer.create(buffer, light_nodes.size()*sizeof(LightNode), light_nodes.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+    // stage vertex and index buffers, one copy each
+    VkDeviceSize vertices_size = vertex_count*sizeof(Vert);
+    VkDeviceSize indices_size = index_count*sizeof(u32);
+    VkBufferUsageFlags geometry_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    scene_buffers.vertex_buffer.create(vertices_size, geometry_usage | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    scene_buffers.index_buffer.create(indices_size, geometry_usage | VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+    StagingAlloc vertex_staging = vkstaging.allocate(vertices_size);
+    StagingAlloc index_staging = vkstaging.allocate(indices_size);
+    thread_pool.parallel_for((u32) geometries.size(), [&](u32 g) {
+      const GeometryData& geometry = geometries[g];
+      memcpy((Vert*) vertex_staging.mapped + geometry.vertex_offset, geometry.vertex_view.data(), geometry.vertex_view.size_bytes());
+      memcpy((u32*) index_staging.mapped + geometry.index_offset, geometry.index_view.data(), geometry.index_view.size_bytes());
+    });
+
+    VkBufferCopy vertex_copy { vertex_staging.offset, 0, vertices_size };
+    VkBufferCopy index_copy { index_staging.offset, 0, indices_size };
+    if (vertices_size) vkCmdCopyBuffer(buffer, vertex_staging.buffer, scene_buffers.vertex_buffer.buffer, 1, &vertex_copy);
+    if (indices_size) vkCmdCopyBuffer(buffer, index_staging.buffer, scene_buffers.index_buffer.buffer, 1, &index_copy);
   });
 
+  vkutil::gpu_wait_upload(geometry_upload);
+
   // build scene blases
   blases.resize(geometries.size());
   for (u32 b = 0; b < geometries.size(); ++b) {
-    blases[b].add_buffers(scene_buffers.vbos[b], scene_buffers.ibos[b], (u32) geometries[b].vertices.size(), (u32) geometries[b].indices.size());
+    blases[b].add_buffers(scene_buffers.vertex_buffer, scene_buffers.index_buffer, (u32) geometries[b].vertex_view.size(), (u32) geometries[b].index_view.size(), geometries[b].vertex_offset, geometries[b].index_offset);
+  }
+  VkBuildAccelerationStructureFlagsKHR blas_flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+  if (settings.compact_blas) blas_flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+
+  // cached blases are deserialized, only the rest is built and then added to the cache
+  std::vector<u64> blas_keys(geometries.size());
+  thread_pool.parallel_for((u32) geometries.size(), [&](u32 b) {
+    blas_keys[b] = AccelCache::blas_key(geometries[b], blas_flags);
+  });
+  std::vector<u32> missing = AccelCache::load(blases.data(), blas_keys.data(), (u32) blases.size());
+
+  std::vector<Blas> to_build;
+  std::vector<u64> to_build_keys;
+  for (u32 b : missing) {
+    to_build.push_back(std::move(blases[b]));
+    to_build_keys.push_back(blas_keys[b]);
+  }
+  Blas::build_blas(to_build.data(), (u32) to_build.size(), blas_flags);
+  AccelCache::store(to_build.data(), to_build_keys.data(), (u32) to_build.size());
+  for (size_t m = 0; m < missing.size(); ++m) {
+    blases[missing[m]] = std::move(to_build[m]);
   }
-  Blas::build_blas(blases.data(), (u32) blases.size());
   
   // build scene tlas
   for (auto& geometry : scene_geometry) {
@@ -309,44 +461,115 @@ bool Scene::Build_Structures() {
   }
   tlas.build_tlas(blases.data(), (u32) scene_geometry.size());
 
+  // textures are handed to the virtual texture system as they come out of the decoder, only the last level
+  // of each is uploaded here and the rest streams in once the shaders ask for it
+  auto start = std::chrono::high_resolution_clock::now();
+  DecodedTexture decoded;
+  while (texture_loader.next(decoded)) {
+    if (!decoded.placeholder) info_log("Loading texture, {}", textures[decoded.id]);
+    virtual_textures.add_texture(decoded);
+    texture_loader.release(decoded);
+  }
+  vkutil::gpu_wait_upload(virtual_textures.init()); // taken by the first frame
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+  info_log("Uploaded {} textures in {:.1f}ms", textures.size(), elapsed.count());
+  vkutil::gpu_wait_upload(environment.upload());
+
   // setup desc sets
-  scene_set.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, (u32) geometries.size(), VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
-  scene_set.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, (u32) geometries.size(), VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+  scene_set.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR); // vertices
+  scene_set.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR); // indices
   scene_set.add_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR); // scene metadata
-  scene_set.add_binding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, (u32) textures.size(), VK_SHADER_STAGE_RAYGEN_BIT_KHR); // texture
+  scene_set.add_binding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // texture atlases
   scene_set.add_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // materials
   scene_set.add_binding(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // lights
+  scene_set.add_binding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // page table
+  scene_set.add_binding(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // virtual texture info
+  scene_set.add_binding(8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // texture feedback
+  scene_set.add_binding(9, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // environment map
+  scene_set.add_binding(10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // environment distribution
+  scene_set.add_binding(11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // light alias table
+  scene_set.add_binding(12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // light bvh
 
   DescSet::allocate_sets(1, &scene_set);
 
-  std::vector<VkDescriptorBufferInfo> vertices_info(geometries.size());
-  std::vector<VkDescriptorBufferInfo> indices_info(geometries.size());
-  std::vector<VkDescriptorImageInfo> textures_info(textures.size());
-
-  AllocatedBuffer::fill_desc_infos(scene_buffers.vbos.data(), vertices_info.data(), (u32) geometries.size());
-  AllocatedBuffer::fill_desc_infos(scene_buffers.ibos.data(), indices_info.data(), (u32) geometries.size());
-  AllocatedImage::fill_desc_infos(scene_buffers.textures.data(), textures_info.data(), (u32) textures.size(), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-  if (textures.size() > 0) {
-    WriteDescSet writes[] = {
-      scene_set.make_write_array(vertices_info.data(), 0),
-      scene_set.make_write_array(indices_info.data(), 1),
-      scene_set.make_write(scene_buffers.scene_buffer.get_desc_info(), 2),
-      scene_set.make_write_array(textures_info.data(), 3),
-      scene_set.make_write(scene_buffers.mat_buffer.get_desc_info(), 4),
-      scene_set.make_write(scene_buffers.light_buffer.get_desc_info(), 5),
-    };
-    DescSet::update_writes(writes, COUNT_OF(writes));
-  } else {
-    WriteDescSet writes[] = {
-      scene_set.make_write_array(vertices_info.data(), 0),
-      scene_set.make_write_array(indices_info.data(), 1),
-      scene_set.make_write(scene_buffers.scene_buffer.get_desc_info(), 2),
-      //      scene_set.make_write_array(textures_info.data(), 3),
-      scene_set.make_write(scene_buffers.mat_buffer.get_desc_info(), 4),
-      scene_set.make_write(scene_buffers.light_buffer.get_desc_info(), 5),
-    };
-    DescSet::update_writes(writes, COUNT_OF(writes));
+  VkDescriptorBufferInfo scene_infos[NUM_FRAMES];
+  for (u32 f = 0; f < NUM_FRAMES; ++f) {
+    scene_infos[f] = { scene_buffers.scene_buffer.buffer, f*scene_buffers.scene_slice_size, scene_geometry.size()*sizeof(SceneGeometry) };
   }
+  VkDescriptorImageInfo atlas_infos[2];
+  VkDescriptorBufferInfo feedback_infos[NUM_FRAMES];
+  virtual_textures.fill_desc_infos(atlas_infos, feedback_infos);
+
+  WriteDescSet writes[] = {
+    scene_set.make_write(scene_buffers.vertex_buffer.get_desc_info(), 0),
+    scene_set.make_write(scene_buffers.index_buffer.get_desc_info(), 1),
+    scene_set.make_write_frames(scene_infos, 2),
+    scene_set.make_write_array(atlas_infos, 3),
+    scene_set.make_write(scene_buffers.mat_buffer.get_desc_info(), 4),
+    scene_set.make_write(scene_buffers.light_buffer.get_desc_info(), 5),
+    scene_set.make_write(virtual_textures.page_table.get_desc_info(), 6),
+    scene_set.make_write(virtual_textures.texture_info.get_desc_info(), 7),
+    scene_set.make_write_frames(feedback_infos, 8),
+    scene_set.make_write(environment.radiance.get_desc_info(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL), 9),
+    scene_set.make_write(environment.distribution.get_desc_info(), 10),
+    scene_set.make_write(scene_buffers.light_alias_buffer.get_desc_info(), 11),
+    scene_set.make_write(scene_buffers.light_tree_buffer.get_desc_info(), 12),
+  };
+  DescSet::update_writes(writes, COUNT_OF(writes));
   return true;
 }
+
+void Scene::bake_textures() {
+  auto start = std::chrono::high_resolution_clock::now();
+  DecodedTexture decoded;
+  while (texture_loader.next(decoded)) texture_loader.release(decoded);
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+  info_log("Baked {} textures in {:.1f}ms", textures.size(), elapsed.count());
+}
+
+void Scene::set_transform(u32 instance_id, const glm::mat4& transform) {
+  assert_log(instance_id < scene_geometry.size(), "set_transform(), instance out of range");
+  scene_geometry[instance_id].transform = transform;
+  scene_geometry[instance_id].transformIT = glm::transpose(glm::inverse(transform));
+  tlas.set_transform(instance_id, transform);
+  stale_slices = (1u << NUM_FRAMES) - 1;
+}
+
+void Scene::add_animation(const InstanceAnimation& animation) {
+  assert_log(animation.instance_id < scene_geometry.size(), "add_animation(), instance out of range");
+  if (animation.keyframes.empty()) return;
+  animations.push_back(animation);
+}
+
+void Scene::animate(float time) {
+  for (const InstanceAnimation& animation : animations) {
+    const std::vector<Keyframe>& keys = animation.keyframes;
+    float start = keys.front().time, end = keys.back().time;
+    float t = time;
+    if (animation.loop && end > start) t = start + glm::mod(time - start, end - start);
+    t = glm::clamp(t, start, end);
+
+    // first keyframe at or after t
+    size_t next = 0;
+    while (next + 1 < keys.size() && keys[next].time < t) ++next;
+    const Keyframe& b = keys[next];
+    const Keyframe& a = keys[next == 0 ? 0 : next - 1];
+    float alpha = b.time > a.time ? (t - a.time) / (b.time - a.time) : 1.0f;
+
+    glm::mat4 transform = glm::translate(glm::mat4(1), glm::mix(a.position, b.position, alpha));
+    transform *= glm::mat4_cast(glm::slerp(a.rotation, b.rotation, alpha));
+    transform = glm::scale(transform, glm::mix(a.scale, b.scale, alpha));
+    set_transform(animation.instance_id, transform);
+  }
+}
+
+bool Scene::update_instances(VkCommandBuffer cmd) {
+  u32 slot_bit = 1u << vkcontext.current_frame;
+  if (stale_slices & slot_bit) {
+    VkDeviceSize offset = vkcontext.current_frame*scene_buffers.scene_slice_size;
+    memcpy(scene_buffers.scene_data + offset, scene_geometry.data(), scene_geometry.size()*sizeof(SceneGeometry));
+    vmaFlushAllocation(vkallocator, scene_buffers.scene_buffer.allocation, offset, scene_buffers.scene_slice_size);
+    stale_slices &= ~slot_bit;
+  }
+  return tlas.update(cmd);
+}
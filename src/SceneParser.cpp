@@ -0,0 +1,70 @@
+#include "SceneParser.h"
+#include <charconv>
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+SceneTokenizer::SceneTokenizer(const char* _begin, const char* _end)
+  : cursor{_begin}, end{_end} {}
+
+void SceneTokenizer::skip_space() {
+  while (cursor < end && is_space(*cursor)) ++cursor;
+  if (cursor < end && *cursor == '#') {
+    while (cursor < end && *cursor != '\n') ++cursor;
+  }
+}
+
+bool SceneTokenizer::at_line_end() {
+  skip_space();
+  return cursor >= end || *cursor == '\n';
+}
+
+void SceneTokenizer::skip_line() {
+  while (cursor < end && *cursor != '\n') ++cursor;
+  if (cursor < end) ++cursor;
+}
+
+bool SceneTokenizer::next_line() {
+  if (line > 0) skip_line(); // drop whatever is left of the current line
+  while (cursor < end) {
+    ++line;
+    if (!at_line_end()) return true;
+    skip_line();
+  }
+  return false;
+}
+
+std::string_view SceneTokenizer::word() {
+  if (at_line_end()) return {};
+  const char* start = cursor;
+  if (*cursor == '{' || *cursor == '}') return { cursor++, 1 };
+  while (cursor < end && !is_space(*cursor) && *cursor != '\n' && *cursor != '{' && *cursor != '}' && *cursor != '#') ++cursor;
+  return { start, (size_t)(cursor - start) };
+}
+
+std::string_view SceneTokenizer::rest() {
+  skip_space();
+  const char* start = cursor;
+  while (cursor < end && *cursor != '\n' && *cursor != '#') ++cursor;
+  const char* stop = cursor;
+  while (stop > start && is_space(stop[-1])) --stop;
+  return { start, (size_t)(stop - start) };
+}
+
+bool SceneTokenizer::read(float& value) {
+  std::string_view token = word();
+  if (!token.empty() && token[0] == '+') token.remove_prefix(1); // from_chars does not take a leading '+'
+  auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+  return !token.empty() && result.ec == std::errc() && result.ptr == token.data() + token.size();
+}
+
+bool SceneTokenizer::read(u32& value) {
+  std::string_view token = word();
+  auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+  return !token.empty() && result.ec == std::errc() && result.ptr == token.data() + token.size();
+}
+
+bool SceneTokenizer::read(glm::vec3& value) {
+  return read(value.x) && read(value.y) && read(value.z);
+}
@@ -0,0 +1,186 @@
+#include "ShaderCache.h"
+#include "Context.h"
+#include "Util.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+struct SpvHeader {
+  char magic[4];
+  u32 version;
+  u64 key;
+  u32 dependency_count;
+  u32 word_count;
+};
+
+static constexpr char SPV_MAGIC[4] = {'S', 'P', 'V', 'C'};
+
+static bool read_file(const std::string& filename, std::string& contents) {
+  std::ifstream in(filename, std::ios::in | std::ios::binary);
+  if (!in) return false;
+  contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return true;
+}
+
+// hash of everything that ends up in the spir-v, false if one of the includes is gone
+static bool source_key(const std::string& source, shaderc_shader_kind shader_kind, const std::vector<std::string>& dependencies, u64& key) {
+  key = util::hash_bytes(util::FNV_OFFSET_BASIS, &ShaderCache::VERSION, sizeof(ShaderCache::VERSION));
+  key = util::hash_bytes(key, &shader_kind, sizeof(shader_kind));
+  key = util::hash_bytes(key, source.data(), source.size());
+  std::string contents;
+  for (const std::string& dependency : dependencies) {
+    if (!read_file(dependency, contents)) return false;
+    key = util::hash_bytes(key, dependency.data(), dependency.size());
+    key = util::hash_bytes(key, contents.data(), contents.size());
+  }
+  return true;
+}
+
+static std::string cache_path(const char* file, shaderc_shader_kind shader_kind) {
+  // one entry per shader and stage, it is overwritten whenever the source changes
+  std::error_code ec;
+  std::string path = fs::absolute(file, ec).lexically_normal().generic_string();
+  return (fs::path(ShaderCache::cache_dir) / fmt::format("{}-{}-{:016x}.spvc", fs::path(path).filename().string(), (u32) shader_kind, util::hash_bytes(util::FNV_OFFSET_BASIS, path.data(), path.size()))).string();
+}
+
+static bool load(const std::string& filename, const std::string& source, shaderc_shader_kind shader_kind, std::vector<u32>& spirv, std::vector<std::string>& dependencies) {
+  std::string data;
+  if (!read_file(filename, data) || data.size() < sizeof(SpvHeader)) return false;
+
+  SpvHeader header;
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, SPV_MAGIC, sizeof(SPV_MAGIC)) != 0 || header.version != ShaderCache::VERSION) return false;
+  if (header.dependency_count > data.size()) return false;
+
+  size_t offset = sizeof(SpvHeader);
+  dependencies.assign(header.dependency_count, {});
+  for (std::string& dependency : dependencies) {
+    u32 length;
+    if (offset + sizeof(length) > data.size()) return false;
+    memcpy(&length, data.data() + offset, sizeof(length));
+    offset += sizeof(length);
+    if (offset + length > data.size()) return false;
+    dependency.assign(data.data() + offset, length);
+    offset += length;
+  }
+  if (offset + (size_t) header.word_count*sizeof(u32) != data.size()) return false;
+
+  u64 key;
+  if (!source_key(source, shader_kind, dependencies, key) || key != header.key) return false;
+
+  spirv.resize(header.word_count);
+  memcpy(spirv.data(), data.data() + offset, spirv.size()*sizeof(u32));
+  return true;
+}
+
+static void store(const std::string& filename, const std::string& source, shaderc_shader_kind shader_kind, const std::vector<std::string>& dependencies, const std::vector<u32>& spirv) {
+  SpvHeader header = {};
+  memcpy(header.magic, SPV_MAGIC, sizeof(SPV_MAGIC));
+  header.version = ShaderCache::VERSION;
+  header.dependency_count = (u32) dependencies.size();
+  header.word_count = (u32) spirv.size();
+  if (!source_key(source, shader_kind, dependencies, header.key)) return;
+
+  std::error_code ec;
+  fs::create_directories(ShaderCache::cache_dir, ec);
+  std::string temp_name = filename + ".tmp";
+  {
+    std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+    out.write((const char*) &header, sizeof(header));
+    for (const std::string& dependency : dependencies) {
+      u32 length = (u32) dependency.size();
+      out.write((const char*) &length, sizeof(length));
+      out.write(dependency.data(), length);
+    }
+    out.write((const char*) spirv.data(), spirv.size()*sizeof(u32));
+    if (!out) {
+      warn_log("Could not write shader cache, {}", filename);
+      out.close();
+      fs::remove(temp_name, ec);
+      return;
+    }
+  }
+  fs::rename(temp_name, filename, ec);
+  if (ec) warn_log("Could not write shader cache, {}: {}", filename, ec.message());
+}
+
+bool ShaderCache::compile(const char* file, shaderc_shader_kind shader_kind, std::vector<u32>& spirv, std::vector<std::string>* dependencies) {
+  std::string source;
+  if (!read_file(file, source)) {
+    err_log("Could not open shader file: {}", file);
+    return false;
+  }
+
+  std::string filename = cache_path(file, shader_kind);
+  std::vector<std::string> includes_found;
+  if (load(filename, source, shader_kind, spirv, includes_found)) {
+    info_log("Loaded cached shader, {}", file);
+    if (dependencies) *dependencies = std::move(includes_found);
+    return true;
+  }
+
+  // a private compiler and includer per call: calls can run on several threads at once,
+  // and file_path_trace() is exactly this shader's include closure
+  shaderc::Compiler compiler;
+  shaderc::CompileOptions options(vkcompiler.options);
+  auto includer = std::make_unique<FileIncluder>(&vkcompiler.ffinder);
+  const FileIncluder& includes = *includer;
+  options.SetIncluder(std::move(includer));
+
+  auto result = compiler.CompileGlslToSpv(source, shader_kind, file, options);
+  if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+    err_log("Shader compilation failed: {}, {}", file, result.GetErrorMessage());
+    return false;
+  }
+  spirv.assign(result.cbegin(), result.cend());
+
+  includes_found.assign(includes.file_path_trace().begin(), includes.file_path_trace().end());
+  std::sort(includes_found.begin(), includes_found.end());
+  store(filename, source, shader_kind, includes_found, spirv);
+  if (dependencies) *dependencies = std::move(includes_found);
+  return true;
+}
+
+static std::string pipeline_cache_path() {
+  return (fs::path(ShaderCache::cache_dir) / "pipeline.cache").string();
+}
+
+void ShaderCache::load_pipeline_cache() {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(vkcontext.phys_device, &props);
+
+  // some drivers do not validate the blob themselves, only hand over data written by this exact device and driver
+  std::string data;
+  bool valid = read_file(pipeline_cache_path(), data) && data.size() >= 16 + VK_UUID_SIZE;
+  if (valid) {
+    u32 header[4];
+    memcpy(header, data.data(), sizeof(header));
+    valid = header[0] >= 16 + VK_UUID_SIZE && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+      header[2] == props.vendorID && header[3] == props.deviceID &&
+      memcmp(data.data() + 16, props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    if (!valid) info_log("Pipeline cache was written by a different device or driver, ignoring it");
+  }
+
+  VkPipelineCacheCreateInfo create_info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+  create_info.initialDataSize = valid ? data.size() : 0;
+  create_info.pInitialData = valid ? data.data() : nullptr;
+  VK_CHECK(vkCreatePipelineCache(vkcontext.device, &create_info, nullptr, &vkcontext.pipeline_cache));
+  if (valid) info_log("Loaded pipeline cache, {} bytes", data.size());
+}
+
+void ShaderCache::save_pipeline_cache() {
+  if (vkcontext.pipeline_cache == VK_NULL_HANDLE) return;
+
+  size_t size = 0;
+  VK_CHECK(vkGetPipelineCacheData(vkcontext.device, vkcontext.pipeline_cache, &size, nullptr));
+  std::vector<char> data(size);
+  VK_CHECK(vkGetPipelineCacheData(vkcontext.device, vkcontext.pipeline_cache, &size, data.data()));
+
+  std::error_code ec;
+  fs::create_directories(cache_dir, ec);
+  std::ofstream out(pipeline_cache_path(), std::ios::binary | std::ios::trunc);
+  out.write(data.data(), size);
+  if (!out) warn_log("Could not write pipeline cache, {}", pipeline_cache_path());
+}
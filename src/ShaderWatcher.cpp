@@ -0,0 +1,97 @@
+#include "ShaderWatcher.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+namespace fs = std::filesystem;
+
+static std::string normalize(const std::string& file) {
+  std::error_code ec;
+  return fs::absolute(file, ec).lexically_normal().generic_string();
+}
+
+#ifdef __linux__
+
+ShaderWatcher::~ShaderWatcher() {
+  if (fd >= 0) close(fd);
+}
+
+void ShaderWatcher::watch(const std::vector<std::string>& watched_files) {
+  if (fd < 0) {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+      warn_log("inotify_init1 failed, shader hot reload is disabled");
+      return;
+    }
+  }
+
+  files.clear();
+  for (const std::string& file : watched_files) {
+    std::string path = normalize(file);
+    files.insert(path);
+
+    // inotify hands back the same descriptor for a directory that is already watched
+    std::string dir = fs::path(path).parent_path().generic_string();
+    int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd >= 0) {
+      dirs[wd] = dir;
+    } else {
+      warn_log("Could not watch shader directory, {}", dir);
+    }
+  }
+}
+
+bool ShaderWatcher::poll() {
+  if (fd < 0) return false;
+
+  bool changed = false;
+  alignas(inotify_event) char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char* ptr = buffer; ptr < buffer + length;) {
+      const inotify_event* event = (const inotify_event*) ptr;
+      ptr += sizeof(inotify_event) + event->len;
+
+      auto dir = dirs.find(event->wd);
+      if (dir == dirs.end() || event->len == 0) continue;
+      changed = changed || files.count(dir->second + "/" + event->name) != 0;
+    }
+  }
+  return changed;
+}
+
+#else
+
+ShaderWatcher::~ShaderWatcher() {}
+
+void ShaderWatcher::watch(const std::vector<std::string>& watched_files) {
+  files.clear();
+  mtimes.clear();
+  for (const std::string& file : watched_files) {
+    std::string path = normalize(file);
+    std::error_code ec;
+    files.insert(path);
+    mtimes[path] = fs::last_write_time(path, ec);
+  }
+}
+
+bool ShaderWatcher::poll() {
+  auto now = std::chrono::steady_clock::now();
+  if (now - last_poll < std::chrono::milliseconds(250)) return false;
+  last_poll = now;
+
+  bool changed = false;
+  for (auto& [path, mtime] : mtimes) {
+    std::error_code ec;
+    fs::file_time_type current = fs::last_write_time(path, ec);
+    if (!ec && current != mtime) {
+      mtime = current;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "StagingRing.h"
+#include "Context.h"
+
+StagingRing vkstaging;
+
+static void* create_mapped(AllocatedBuffer& buffer, VkDeviceSize size) {
+  VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+  buffer_info.size = size;
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  share_with_transfer_queue(buffer_info);
+
+  VmaAllocationCreateInfo alloc_info = {};
+  alloc_info.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+  alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VmaAllocationInfo result;
+  VK_CHECK(vmaCreateBuffer(vkallocator, &buffer_info, &alloc_info, &buffer.buffer, &buffer.allocation, &result));
+  return result.pMappedData;
+}
+
+void StagingRing::init(VkDeviceSize ring_capacity) {
+  capacity = ring_capacity;
+  mapped = (u8*) create_mapped(buffer, capacity);
+}
+
+StagingAlloc StagingRing::stage(const void* data, VkDeviceSize size, VkDeviceSize alignment) {
+  StagingAlloc alloc = allocate(size, alignment);
+  memcpy(alloc.mapped, data, size);
+  return alloc;
+}
+
+StagingAlloc StagingRing::allocate(VkDeviceSize size, VkDeviceSize alignment) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (size <= capacity) {
+    for (;;) {
+      VkDeviceSize pos = head % capacity;
+      VkDeviceSize padding = (alignment - pos % alignment) % alignment;
+      // an allocation never wraps, skip to the start of the buffer instead
+      if (pos + padding + size > capacity) padding = capacity - pos;
+
+      if (head + padding + size - tail <= capacity) {
+        head += padding;
+        StagingAlloc alloc { buffer.buffer, head % capacity, mapped + head % capacity };
+        head += size;
+        return alloc;
+      }
+      if (in_flight.empty()) break;
+
+      VK_CHECK(vkWaitForFences(vkcontext.device, 1, &in_flight.front().fence, VK_TRUE, UINT64_MAX));
+      retire_front();
+    }
+  }
+
+  AllocatedBuffer& dedicated = open_dedicated.emplace_back();
+  void* dedicated_mapped = create_mapped(dedicated, size);
+  return { dedicated.buffer, 0, dedicated_mapped };
+}
+
+VkFence StagingRing::close_batch() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Batch& batch = in_flight.emplace_back();
+  batch.end = head;
+  batch.fence = get_fence();
+  batch.dedicated = std::move(open_dedicated);
+  open_dedicated.clear();
+  return batch.fence;
+}
+
+void StagingRing::wait(VkFence fence) {
+  VK_CHECK(vkWaitForFences(vkcontext.device, 1, &fence, VK_TRUE, UINT64_MAX));
+  reclaim();
+}
+
+void StagingRing::reclaim() {
+  std::lock_guard<std::mutex> lock(mutex);
+  while (!in_flight.empty() && vkGetFenceStatus(vkcontext.device, in_flight.front().fence) == VK_SUCCESS)
+    retire_front();
+}
+
+void StagingRing::retire_front() {
+  Batch& batch = in_flight.front();
+  tail = batch.end;
+  for (AllocatedBuffer& dedicated : batch.dedicated) dedicated.destroy();
+  VK_CHECK(vkResetFences(vkcontext.device, 1, &batch.fence));
+  free_fences.push_back(batch.fence);
+  in_flight.pop_front();
+}
+
+VkFence StagingRing::get_fence() {
+  if (!free_fences.empty()) {
+    VkFence fence = free_fences.back();
+    free_fences.pop_back();
+    return fence;
+  }
+  VkFence fence;
+  VkFenceCreateInfo fence_info = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+  VK_CHECK(vkCreateFence(vkcontext.device, &fence_info, nullptr, &fence));
+  return fence;
+}
@@ -0,0 +1,162 @@
+#include "TextureCache.h"
+#include "BcEncoder.h"
+#include "Image.h"
+#include "MappedFile.h"
+#include "Util.h"
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+struct PTexHeader {
+  char magic[4];
+  u32 version;
+  u32 vk_format;
+  u32 width;
+  u32 height;
+  u32 mip_count;
+  u32 path_length;
+  u32 padding;
+  u64 source_size;
+  i64 source_mtime;
+  u64 data_offset;
+  u64 data_size;
+};
+
+static constexpr char PTEX_MAGIC[4] = {'P', 'T', 'E', 'X'};
+
+struct SourceKey {
+  std::string path;
+  u64 size;
+  i64 mtime;
+};
+
+static bool source_key(const std::string& image_file, SourceKey& key) {
+  std::error_code ec;
+  fs::path path = fs::absolute(image_file, ec).lexically_normal();
+  if (ec) return false;
+  key.path = path.generic_string();
+  key.size = (u64) fs::file_size(path, ec);
+  if (ec) return false;
+  key.mtime = (i64) fs::last_write_time(path, ec).time_since_epoch().count();
+  return !ec;
+}
+
+static std::string cache_path(const SourceKey& key) {
+  if (TextureCache::cache_dir.empty()) return key.path + ".ptex";
+  fs::path stem = fs::path(key.path).stem();
+  return (fs::path(TextureCache::cache_dir) / fmt::format("{}-{:016x}.ptex", stem.string(), util::hash_bytes(util::FNV_OFFSET_BASIS, key.path.data(), key.path.size()))).string();
+}
+
+static VkDeviceSize chain_size(VkFormat format, u32 width, u32 height, u32 mip_count) {
+  VkDeviceSize size = 0;
+  for (u32 level = 0; level < mip_count; ++level) size += vkutil::mip_level_size(format, width, height, level);
+  return size;
+}
+
+namespace TextureCache {
+
+VkFormat format_for(TextureKind kind) {
+  return kind == TextureKind::color ? VK_FORMAT_BC7_UNORM_BLOCK : VK_FORMAT_BC5_UNORM_BLOCK;
+}
+
+bool load(const std::string& image_file, TextureKind kind, MappedFile& file, const u8*& data, u32& width, u32& height, u32& mip_count) {
+  SourceKey key;
+  if (!source_key(image_file, key)) return false;
+  if (!file.open(cache_path(key)) || file.size < sizeof(PTexHeader)) return false;
+
+  PTexHeader header;
+  memcpy(&header, file.data, sizeof(header));
+  if (memcmp(header.magic, PTEX_MAGIC, sizeof(PTEX_MAGIC)) != 0 || header.version != VERSION) {
+    info_log("Texture cache version mismatch, reloading {}", image_file);
+    return false;
+  }
+  if (header.vk_format != (u32) format_for(kind)) return false; // used as a different kind of map since
+  if (header.source_size != key.size || header.source_mtime != key.mtime) return false;
+  if (sizeof(PTexHeader) + header.path_length > file.size ||
+      key.path.compare(0, std::string::npos, (const char*) file.data + sizeof(PTexHeader), header.path_length) != 0) {
+    return false;
+  }
+  if (header.mip_count == 0 || header.mip_count > 16 ||
+      header.data_size != chain_size(format_for(kind), header.width, header.height, header.mip_count) ||
+      header.data_offset + header.data_size > file.size) {
+    warn_log("Truncated texture cache for {}", image_file);
+    return false;
+  }
+
+  data = file.data + header.data_offset;
+  width = header.width;
+  height = header.height;
+  mip_count = header.mip_count;
+  return true;
+}
+
+void encode(TextureKind kind, const u8* rgba_chain, u32 width, u32 height, u32 mip_count, std::vector<u8>& compressed) {
+  VkFormat format = format_for(kind);
+  compressed.resize(chain_size(format, width, height, mip_count));
+
+  u8* out = compressed.data();
+  for (u32 level = 0; level < mip_count; ++level) {
+    u32 w = std::max(width >> level, 1u), h = std::max(height >> level, 1u);
+    if (kind == TextureKind::color) {
+      BcEncoder::encode_bc7(rgba_chain, w, h, out);
+    } else {
+      BcEncoder::encode_bc5(rgba_chain, w, h, out);
+    }
+    rgba_chain += vkutil::mip_level_size(VK_FORMAT_R8G8B8A8_UNORM, width, height, level);
+    out += vkutil::mip_level_size(format, width, height, level);
+  }
+}
+
+bool store(const std::string& image_file, TextureKind kind, const std::vector<u8>& compressed, u32 width, u32 height, u32 mip_count) {
+  SourceKey key;
+  if (!source_key(image_file, key)) return false;
+
+  PTexHeader header = {};
+  memcpy(header.magic, PTEX_MAGIC, sizeof(PTEX_MAGIC));
+  header.version = VERSION;
+  header.vk_format = (u32) format_for(kind);
+  header.width = width;
+  header.height = height;
+  header.mip_count = mip_count;
+  header.path_length = (u32) key.path.size();
+  header.source_size = key.size;
+  header.source_mtime = key.mtime;
+  header.data_offset = (sizeof(PTexHeader) + header.path_length + 15) & ~(u64) 15;
+  header.data_size = compressed.size();
+
+  std::string filename = cache_path(key);
+  std::error_code ec;
+  if (!cache_dir.empty()) fs::create_directories(cache_dir, ec);
+
+  // same temp file and rename dance as the mesh cache, textures are encoded on several threads at once
+  std::string temp_name = fmt::format("{}.{:x}.tmp", filename, std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      warn_log("Could not write texture cache, {}", filename);
+      return false;
+    }
+    const char padding[16] = {};
+    out.write((const char*) &header, sizeof(header));
+    out.write(key.path.data(), key.path.size());
+    out.write(padding, header.data_offset - (sizeof(header) + header.path_length));
+    out.write((const char*) compressed.data(), compressed.size());
+    if (!out) {
+      warn_log("Could not write texture cache, {}", filename);
+      out.close();
+      fs::remove(temp_name, ec);
+      return false;
+    }
+  }
+  fs::rename(temp_name, filename, ec);
+  if (ec) {
+    warn_log("Could not write texture cache, {}: {}", filename, ec.message());
+    fs::remove(temp_name, ec);
+    return false;
+  }
+  return true;
+}
+
+};
@@ -0,0 +1,194 @@
+#include "TextureLoader.h"
+#include "ThreadPool.h"
+#include "Image.h"
+#include <stb_image/stb_image.h>
+#include <bit>
+
+// obviously wrong, so missing files are easy to spot in the render
+static u8 placeholder_texel[4] = { 255, 0, 255, 255 };
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// mean of a block of rgba8 texels, rounded to nearest
+static void box_texel(const u8* src, u32 src_width, u32 x0, u32 x1, u32 y0, u32 y1, u8* out) {
+  u32 sum[4] = {};
+  for (u32 y = y0; y < y1; ++y)
+    for (u32 x = x0; x < x1; ++x)
+      for (u32 c = 0; c < 4; ++c) sum[c] += src[((size_t) y * src_width + x) * 4 + c];
+  u32 n = (x1 - x0) * (y1 - y0);
+  for (u32 c = 0; c < 4; ++c) out[c] = (u8) ((sum[c] + n/2) / n);
+}
+
+// count output texels, each the 2x2 box of two texels from row0 and two from row1
+static void box_row(const u8* row0, const u8* row1, u32 count, u8* out) {
+  u32 x = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  // four output texels per step: split eight source texels into even and odd ones, then
+  // sum the four bytes per channel in 16 bits
+  const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+  for (; x + 4 <= count; x += 4) {
+    __m128 a0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (row0 + x*8)));
+    __m128 b0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (row0 + x*8 + 16)));
+    __m128 a1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (row1 + x*8)));
+    __m128 b1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (row1 + x*8 + 16)));
+    __m128i even0 = _mm_castps_si128(_mm_shuffle_ps(a0, b0, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd0 = _mm_castps_si128(_mm_shuffle_ps(a0, b0, _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i even1 = _mm_castps_si128(_mm_shuffle_ps(a1, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd1 = _mm_castps_si128(_mm_shuffle_ps(a1, b1, _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(even0, zero), _mm_unpacklo_epi8(odd0, zero)),
+                               _mm_add_epi16(_mm_unpacklo_epi8(even1, zero), _mm_unpacklo_epi8(odd1, zero)));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(even0, zero), _mm_unpackhi_epi8(odd0, zero)),
+                               _mm_add_epi16(_mm_unpackhi_epi8(even1, zero), _mm_unpackhi_epi8(odd1, zero)));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+    _mm_storeu_si128((__m128i*) (out + x*4), _mm_packus_epi16(lo, hi));
+  }
+#elif defined(__ARM_NEON)
+  // vld2 splits eight texels into even and odd ones, vrshrn rounds and narrows back to bytes
+  for (; x + 4 <= count; x += 4) {
+    uint32x4x2_t t0 = vld2q_u32((const uint32_t*) (row0 + x*8));
+    uint32x4x2_t t1 = vld2q_u32((const uint32_t*) (row1 + x*8));
+    uint8x16_t even0 = vreinterpretq_u8_u32(t0.val[0]), odd0 = vreinterpretq_u8_u32(t0.val[1]);
+    uint8x16_t even1 = vreinterpretq_u8_u32(t1.val[0]), odd1 = vreinterpretq_u8_u32(t1.val[1]);
+    uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(even0), vget_low_u8(odd0)), vaddl_u8(vget_low_u8(even1), vget_low_u8(odd1)));
+    uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(even0), vget_high_u8(odd0)), vaddl_u8(vget_high_u8(even1), vget_high_u8(odd1)));
+    vst1q_u8(out + x*4, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+  }
+#endif
+  // the tail, or everything without simd: a pair of texels is one contiguous 8 byte load per row
+  for (; x < count; ++x) {
+    u8 t0[8], t1[8];
+    memcpy(t0, row0 + x*8, 8);
+    memcpy(t1, row1 + x*8, 8);
+    for (u32 c = 0; c < 4; ++c) out[x*4 + c] = (u8) ((t0[c] + t0[c + 4] + t1[c] + t1[c + 4] + 2) >> 2);
+  }
+}
+
+// 2x2 box filter of an rgba8 level. with an odd width or height the last column or row of the level is
+// folded into the last output texel (a 3 texel wide box there), so no texel is dropped and 1 texel wide
+// levels work too
+static void downsample(const u8* src, u32 src_width, u32 src_height, u8* dst) {
+  u32 width = std::max(src_width / 2, 1u), height = std::max(src_height / 2, 1u);
+  // output columns that are a plain 2x2 box
+  u32 body = src_width & 1 ? width - 1 : width;
+  for (u32 y = 0; y < height; ++y) {
+    u32 y0 = 2*y, y1 = y == height - 1 ? src_height : 2*y + 2;
+    u8* out = dst + (size_t) y * width * 4;
+    if (y1 - y0 == 2) {
+      box_row(src + (size_t) y0 * src_width * 4, src + (size_t) (y0 + 1) * src_width * 4, body, out);
+    } else {
+      for (u32 x = 0; x < body; ++x) box_texel(src, src_width, 2*x, 2*x + 2, y0, y1, out + x*4);
+    }
+    if (body < width) box_texel(src, src_width, 2*body, src_width, y0, y1, out + body*4);
+  }
+}
+
+// full chain down to 1x1, level 0 is copied out of the decoded image
+static void build_mips(const u8* pixels, u32 width, u32 height, u32& mip_count, std::vector<u8>& chain) {
+  mip_count = std::bit_width(std::max(width, height));
+  size_t total = 0;
+  for (u32 level = 0; level < mip_count; ++level) total += vkutil::mip_level_size(VK_FORMAT_R8G8B8A8_UNORM, width, height, level);
+
+  chain.resize(total);
+  memcpy(chain.data(), pixels, (size_t) width * height * 4);
+  u8* level = chain.data();
+  for (u32 l = 1; l < mip_count; ++l) {
+    u32 w = std::max(width >> (l - 1), 1u), h = std::max(height >> (l - 1), 1u);
+    u8* next = level + (size_t) w * h * 4;
+    downsample(level, w, h, next);
+    level = next;
+  }
+}
+
+TextureLoader::~TextureLoader() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this] { return decoding == 0; });
+}
+
+void TextureLoader::start(const std::vector<std::string>& texture_files, const std::vector<TextureKind>& texture_kinds, u32 capacity, bool compress_textures) {
+  std::lock_guard<std::mutex> lock(mutex);
+  files = texture_files;
+  kinds = texture_kinds;
+  compress = compress_textures;
+  for (u32 i = 0; i < std::max(capacity, 1u); ++i) queue_decode();
+}
+
+void TextureLoader::queue_decode() {
+  if (next_file >= files.size()) return;
+  u32 id = next_file++;
+  ++decoding;
+  thread_pool.submit([this, id]() { decode(id); });
+}
+
+void TextureLoader::decode(u32 id) {
+  DecodedTexture texture {};
+  texture.id = id;
+  const std::string& file = files[id];
+
+  if (compress && TextureCache::load(file, kinds[id], texture.cache_file, texture.pixels, texture.width, texture.height, texture.mip_count)) {
+    texture.format = TextureCache::format_for(kinds[id]);
+  } else {
+    texture.cache_file.close(); // a stale entry is about to be replaced
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load(file.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+    if (pixels) {
+      texture.width = (u32) width;
+      texture.height = (u32) height;
+      texture.format = VK_FORMAT_R8G8B8A8_UNORM;
+      build_mips(pixels, texture.width, texture.height, texture.mip_count, texture.storage);
+      stbi_image_free(pixels);
+
+      texture.pixels = texture.storage.data();
+      if (compress) {
+	std::vector<u8> compressed;
+	TextureCache::encode(kinds[id], texture.storage.data(), texture.width, texture.height, texture.mip_count, compressed);
+	texture.format = TextureCache::format_for(kinds[id]);
+	// hand out the mapped cache entry like on a cache hit, the chain does not have to stay in memory.
+	// only when the cache can not be written the compressed chain is kept
+	if (TextureCache::store(file, kinds[id], compressed, texture.width, texture.height, texture.mip_count) &&
+	    TextureCache::load(file, kinds[id], texture.cache_file, texture.pixels, texture.width, texture.height, texture.mip_count)) {
+	  texture.storage = {};
+	} else {
+	  texture.storage = std::move(compressed);
+	  texture.pixels = texture.storage.data();
+	}
+      }
+    } else {
+      err_log("Failed to load image: {}", file);
+      texture.width = texture.height = texture.mip_count = 1;
+      texture.format = VK_FORMAT_R8G8B8A8_UNORM;
+      texture.pixels = placeholder_texel;
+      texture.placeholder = true;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready.push_back(std::move(texture));
+    --decoding;
+  }
+  cv.notify_all();
+}
+
+bool TextureLoader::next(DecodedTexture& texture) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (handed_out >= files.size()) return false;
+  cv.wait(lock, [this] { return !ready.empty(); });
+  texture = std::move(ready.front());
+  ready.pop_front();
+  ++handed_out;
+  return true;
+}
+
+void TextureLoader::release(DecodedTexture& texture) {
+  texture.storage = {};
+  texture.cache_file.close();
+  texture.pixels = nullptr;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  queue_decode();
+}
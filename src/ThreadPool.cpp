@@ -0,0 +1,71 @@
+#include "ThreadPool.h"
+#include <atomic>
+
+ThreadPool thread_pool;
+
+ThreadPool::ThreadPool(u32 thread_count) {
+  if (!thread_count) thread_count = std::max(2u, std::thread::hardware_concurrency()) - 1;
+  workers.reserve(thread_count);
+  for (u32 i = 0; i < thread_count; ++i) workers.emplace_back(&ThreadPool::worker_loop, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push(std::move(job));
+  }
+  cv.notify_one();
+}
+
+void ThreadPool::worker_loop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (stopping && jobs.empty()) return;
+      job = std::move(jobs.front());
+      jobs.pop();
+    }
+    job();
+  }
+}
+
+void ThreadPool::parallel_for(u32 count, const std::function<void(u32)>& job) {
+  if (!count) return;
+
+  struct SharedState {
+    std::atomic<u32> next{0};
+    std::atomic<u32> done{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+  auto state = std::make_shared<SharedState>();
+
+  // helpers that start after every index is taken return straight away, so they never outlive job
+  auto run = [state, count, &job]() {
+    for (u32 i = state->next++; i < count; i = state->next++) {
+      job(i);
+      if (++state->done == count) {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	state->cv.notify_all();
+      }
+    }
+  };
+
+  u32 helpers = std::min(count-1, size());
+  for (u32 h = 0; h < helpers; ++h) enqueue(run);
+  run();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cv.wait(lock, [&] { return state->done == count; });
+}
@@ -0,0 +1,376 @@
+#include "VirtualTexture.h"
+#include "Context.h"
+#include "CmdUtils.h"
+#include "StagingRing.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+static constexpr u32 RESIDENT_BIT = 1u << 31;
+// a slot reported within this many frames is not evicted. feedback arrives NUM_FRAMES frames late and
+// tiled passes do not sample every page each frame, so "not reported this frame" is not "out of view"
+static constexpr u64 MIN_IDLE_FRAMES = NUM_FRAMES;
+
+static u32 wrap(i64 value, u32 count) {
+  return (u32) (((value % count) + count) % count);
+}
+
+u32 VirtualTextures::atlas_for(VkFormat format) {
+  return format == VK_FORMAT_BC5_UNORM_BLOCK ? 1 : 0;
+}
+
+void VirtualTextures::add_texture(DecodedTexture& texture) {
+  if (texture.id >= textures.size()) textures.resize(texture.id + 1);
+  TextureSource& source = textures[texture.id];
+  source.width = texture.width;
+  source.height = texture.height;
+  source.mip_count = texture.mip_count;
+  source.format = texture.format;
+  source.data = texture.pixels;
+
+  // the placeholder goes into the bc7 atlas like every color map, all of them share one encoded block
+  if (texture.placeholder) {
+    static const std::vector<u8> placeholder_block = [&]() {
+      std::vector<u8> block;
+      TextureCache::encode(TextureKind::color, texture.pixels, 1, 1, 1, block);
+      return block;
+    }();
+    source.width = source.height = source.mip_count = 1;
+    source.format = VK_FORMAT_BC7_UNORM_BLOCK;
+    source.data = placeholder_block.data();
+    return;
+  }
+  assert_log(texture.format == VK_FORMAT_BC7_UNORM_BLOCK || texture.format == VK_FORMAT_BC5_UNORM_BLOCK, "VirtualTextures::add_texture(), textures must be block compressed");
+  // moving the mapping or the vector keeps data pointing at the same bytes
+  source.file = std::move(texture.cache_file);
+  source.storage = std::move(texture.storage);
+}
+
+u32 VirtualTextures::pages_in_level(u32 texture, u32 level, u32* pages_x) const {
+  const VtTexture& info = infos[texture];
+  u32 width = std::max(info.width >> level, 1u), height = std::max(info.height >> level, 1u);
+  u32 x = (width + PAGE_INTERIOR - 1) / PAGE_INTERIOR, y = (height + PAGE_INTERIOR - 1) / PAGE_INTERIOR;
+  if (pages_x) *pages_x = x;
+  return x * y;
+}
+
+u32 VirtualTextures::page_count_before_level(u32 texture, u32 level) const {
+  u32 count = 0;
+  for (u32 l = 0; l < level; ++l) count += pages_in_level(texture, l);
+  return count;
+}
+
+void VirtualTextures::locate(u32 page, u32& texture, u32& level, u32& x, u32& y) const {
+  auto next = std::upper_bound(infos.begin(), infos.end(), page, [](u32 p, const VtTexture& info) { return p < info.first_page; });
+  texture = (u32) (next - infos.begin()) - 1;
+  u32 index = page - infos[texture].first_page;
+  u32 pages_x;
+  for (level = 0;; ++level) {
+    u32 count = pages_in_level(texture, level, &pages_x);
+    if (index < count) break;
+    index -= count;
+  }
+  x = index % pages_x;
+  y = index / pages_x;
+}
+
+void VirtualTextures::build_page(u32 texture, u32 level, u32 x, u32 y, u8* out) const {
+  const TextureSource& source = textures[texture];
+  const u8* level_data = source.data;
+  for (u32 l = 0; l < level; ++l) level_data += vkutil::mip_level_size(source.format, source.width, source.height, l);
+
+  // bc blocks are independent, so a page is assembled block by block. the border wraps like the REPEAT sampler did
+  u32 blocks_x = (std::max(source.width >> level, 1u) + 3) / 4, blocks_y = (std::max(source.height >> level, 1u) + 3) / 4;
+  const u32 page_blocks = PAGE_SIZE / 4, interior_blocks = PAGE_INTERIOR / 4;
+  for (u32 by = 0; by < page_blocks; ++by) {
+    u32 src_y = wrap((i64) y*interior_blocks + by - 1, blocks_y);
+    for (u32 bx = 0; bx < page_blocks; ++bx) {
+      u32 src_x = wrap((i64) x*interior_blocks + bx - 1, blocks_x);
+      memcpy(out + ((size_t) by*page_blocks + bx) * 16, level_data + ((size_t) src_y*blocks_x + src_x) * 16, 16);
+    }
+  }
+}
+
+u32 VirtualTextures::atlas_of(u32 page) const {
+  u32 texture, level, x, y;
+  locate(page, texture, level, x, y);
+  return infos[texture].atlas;
+}
+
+u32 VirtualTextures::take_slot(u32 atlas) {
+  if (!free_slots[atlas].empty()) {
+    u32 slot = free_slots[atlas].back();
+    free_slots[atlas].pop_back();
+    return slot;
+  }
+
+  // least recently reported page, anything reported recently is still in use
+  u32 oldest = UINT32_MAX;
+  for (u32 s = 0; s < slots[atlas].size(); ++s) {
+    const Slot& slot = slots[atlas][s];
+    if (!evictable(slot)) continue;
+    if (oldest == UINT32_MAX || slot.last_used < slots[atlas][oldest].last_used) oldest = s;
+  }
+  return oldest;
+}
+
+bool VirtualTextures::evictable(const Slot& slot) const {
+  return !slot.pinned && slot.last_used + MIN_IDLE_FRAMES < frame;
+}
+
+u64 VirtualTextures::init() {
+  infos.resize(textures.size());
+  u32 pinned[2] = { 0, 0 };
+  for (u32 t = 0; t < textures.size(); ++t) {
+    VtTexture& info = infos[t];
+    info = { textures[t].width, textures[t].height, textures[t].mip_count, atlas_for(textures[t].format), page_count };
+    // levels below the first single page one are never sampled, lookups stop at the pinned level
+    for (u32 level = 0; level < textures[t].mip_count; ++level) {
+      if (pages_in_level(t, level) == 1) {
+	info.level_count = level + 1;
+	break;
+      }
+    }
+    for (u32 level = 0; level < info.level_count; ++level) page_count += pages_in_level(t, level);
+    ++pinned[info.atlas];
+  }
+
+  entries.assign(std::max(page_count, 1u), 0);
+  page_slots.assign(page_count, UINT32_MAX);
+  loading.assign(page_count, 0);
+  was_resident.assign(page_count, 0);
+  for (u32 a = 0; a < 2; ++a) {
+    atlas_pages[a] = pinned[a] ? ATLAS_PAGES : 1;
+    assert_log(pinned[a] <= atlas_pages[a]*atlas_pages[a], "VirtualTextures::init(), more textures than atlas pages");
+    slots[a].assign(atlas_pages[a]*atlas_pages[a], Slot{});
+    free_slots[a].clear();
+    for (u32 s = (u32) slots[a].size(); s-- > 0;) free_slots[a].push_back(s);
+
+    VkFormat format = a == 0 ? VK_FORMAT_BC7_UNORM_BLOCK : VK_FORMAT_BC5_UNORM_BLOCK;
+    atlases[a].create(VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, { atlas_pages[a]*PAGE_SIZE, atlas_pages[a]*PAGE_SIZE, 1 }, 1, format);
+
+    // filtering must stay inside the page border: no anisotropy, no wrapping into the neighbouring page
+    vkDestroySampler(vkcontext.device, atlases[a].sampler, nullptr);
+    VkSamplerCreateInfo sampler_info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    VK_CHECK(vkCreateSampler(vkcontext.device, &sampler_info, nullptr, &atlases[a].sampler));
+  }
+
+  // pin the last level of every texture
+  std::vector<VkBufferImageCopy> copies[2];
+  StagingAlloc pinned_staging = vkstaging.allocate(std::max<VkDeviceSize>(textures.size(), 1) * PAGE_BYTES);
+  for (u32 t = 0; t < textures.size(); ++t) {
+    const VtTexture& info = infos[t];
+    u32 page = info.first_page + page_count_before_level(t, info.level_count - 1);
+    u32 slot = take_slot(info.atlas);
+    u32 slot_x = slot % atlas_pages[info.atlas], slot_y = slot / atlas_pages[info.atlas];
+    slots[info.atlas][slot] = { page, 0, true };
+    page_slots[page] = slot;
+    entries[page] = RESIDENT_BIT | slot_y << 8 | slot_x;
+
+    build_page(t, info.level_count - 1, 0, 0, (u8*) pinned_staging.mapped + (size_t) t*PAGE_BYTES);
+    VkBufferImageCopy copy = {};
+    copy.bufferOffset = pinned_staging.offset + (VkDeviceSize) t*PAGE_BYTES;
+    copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    copy.imageOffset = { (i32) (slot_x*PAGE_SIZE), (i32) (slot_y*PAGE_SIZE), 0 };
+    copy.imageExtent = { PAGE_SIZE, PAGE_SIZE, 1 };
+    copies[info.atlas].push_back(copy);
+  }
+
+  u64 upload = vkutil::upload_async([&](VkCommandBuffer cmd) {
+    VkImageMemoryBarrier barriers[2];
+    for (u32 a = 0; a < 2; ++a) {
+      barriers[a] = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+      barriers[a].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barriers[a].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+      barriers[a].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barriers[a].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barriers[a].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barriers[a].image = atlases[a].image;
+      barriers[a].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    }
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+
+    for (u32 a = 0; a < 2; ++a) {
+      if (!copies[a].empty()) vkCmdCopyBufferToImage(cmd, pinned_staging.buffer, atlases[a].image, VK_IMAGE_LAYOUT_GENERAL, (u32) copies[a].size(), copies[a].data());
+    }
+    page_table.create(cmd, entries.size()*sizeof(u32), entries.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    texture_info.create(cmd, std::max<size_t>(infos.size(), 1)*sizeof(VtTexture), infos.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  });
+
+  // feedback and upload staging are per frame slices, a slot is only touched again once its frame's fence signaled
+  VkDeviceSize bits_size = ((page_count + 31) / 32) * sizeof(u32);
+  feedback_bits_size = std::max<VkDeviceSize>(bits_size, sizeof(u32));
+  feedback_slice_size = (sizeof(u32) * (1 + FEEDBACK_CAPACITY) + feedback_bits_size + 255) & ~(VkDeviceSize) 255;
+  feedback.create(NUM_FRAMES*feedback_slice_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+  feedback_data = (u8*) feedback.map();
+  memset(feedback_data, 0, NUM_FRAMES*feedback_slice_size);
+  vmaFlushAllocation(vkallocator, feedback.allocation, 0, VK_WHOLE_SIZE);
+
+  staging.create(NUM_FRAMES*staging_slice_size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+  staging_data = (u8*) staging.map();
+
+  info_log("Virtual textures: {} textures, {} pages, {} atlas pages", textures.size(), page_count, slots[0].size() + slots[1].size());
+  return upload;
+}
+
+bool VirtualTextures::poll() {
+  std::lock_guard<std::mutex> lock(mutex);
+  bool refines = false;
+  for (LoadedPage& page : finished) {
+    refines |= page.first_load;
+    polled.push_back(std::move(page));
+  }
+  finished.clear();
+  return refines;
+}
+
+bool VirtualTextures::streaming() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return in_flight > 0 || !finished.empty() || !polled.empty();
+}
+
+void VirtualTextures::update(VkCommandBuffer cmd) {
+  ++frame;
+  u32 f = vkcontext.current_frame;
+
+  // this slice was last written by the frame that used this slot before, its fence has signaled
+  VkDeviceSize slice_offset = f*feedback_slice_size;
+  vmaInvalidateAllocation(vkallocator, feedback.allocation, slice_offset, feedback_slice_size);
+  const u32* slice = (const u32*) (feedback_data + slice_offset);
+  u32 request_count = std::min(slice[0], FEEDBACK_CAPACITY);
+  // resident pages first, so they are not counted as evictable below
+  for (u32 r = 0; r < request_count; ++r) {
+    u32 page = slice[1 + r];
+    if (page < page_count && entries[page]) slots[atlas_of(page)][page_slots[page]].last_used = frame;
+  }
+
+  // when the working set is larger than an atlas, loading pages that would only evict other visible pages
+  // makes them come back next frame, forever. those requests keep using the coarser level instead
+  u32 slot_budget[2];
+  for (u32 a = 0; a < 2; ++a) {
+    u32 idle = (u32) free_slots[a].size();
+    for (const Slot& slot : slots[a]) idle += slot.page != UINT32_MAX && evictable(slot);
+    slot_budget[a] = idle > pending[a] ? idle - pending[a] : 0;
+  }
+
+  for (u32 r = 0; r < request_count; ++r) {
+    u32 page = slice[1 + r];
+    if (page >= page_count || entries[page] || loading[page]) continue;
+    u32 atlas = atlas_of(page);
+    if (slot_budget[atlas] == 0) {
+      if (!atlas_full_warned) {
+	warn_log("Virtual textures: the visible pages do not fit the {} atlas pages, some stay at a coarser level", slots[atlas].size());
+	atlas_full_warned = true;
+      }
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (in_flight + finished.size() + polled.size() >= 2*MAX_UPLOADS) break; // the rest is reported again next frame
+      ++in_flight;
+    }
+    --slot_budget[atlas];
+    ++pending[atlas];
+    loading[page] = 1;
+    // the shader sampled a coarser level for this page, the first time it arrives the image changes.
+    // a page that was evicted and comes back does not restart accumulation
+    bool first_load = !was_resident[page];
+    thread_pool.submit([this, page, first_load]() {
+      LoadedPage loaded { page, first_load, std::vector<u8>(PAGE_BYTES) };
+      u32 texture, level, x, y;
+      locate(page, texture, level, x, y);
+      build_page(texture, level, x, y, loaded.data.data());
+
+      std::lock_guard<std::mutex> lock(mutex);
+      finished.push_back(std::move(loaded));
+      --in_flight;
+    });
+  }
+
+  // the previous frame on this slot may still read the atlas and write the feedback, until this barrier
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+  barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  vkCmdFillBuffer(cmd, feedback.buffer, slice_offset, sizeof(u32), 0);
+  vkCmdFillBuffer(cmd, feedback.buffer, slice_offset + sizeof(u32) * (1 + FEEDBACK_CAPACITY), feedback_bits_size, 0);
+
+  // evicted pages fall back to a coarser level from the next frame on
+  VkDeviceSize staging_offset = f*staging_slice_size();
+  u8* page_data = staging_data + staging_offset;
+  u32* entry_data = (u32*) (page_data + MAX_UPLOADS*PAGE_BYTES);
+  std::vector<VkBufferImageCopy> copies[2];
+  std::vector<VkBufferCopy> entry_copies;
+  auto write_entry = [&](u32 page) {
+    u32 e = (u32) entry_copies.size();
+    entry_data[e] = entries[page];
+    entry_copies.push_back({ staging_offset + MAX_UPLOADS*PAGE_BYTES + e*sizeof(u32), page*sizeof(u32), sizeof(u32) });
+  };
+
+  u32 uploaded = 0, taken = 0;
+  for (; taken < polled.size() && uploaded < MAX_UPLOADS; ++taken) {
+    LoadedPage& loaded = polled[taken];
+    u32 atlas = atlas_of(loaded.page);
+    loading[loaded.page] = 0;
+    --pending[atlas];
+
+    u32 slot = take_slot(atlas);
+    if (slot == UINT32_MAX) continue; // every page is in use, the request comes back once one goes out of view
+    if (slots[atlas][slot].page != UINT32_MAX) {
+      u32 evicted = slots[atlas][slot].page;
+      entries[evicted] = 0;
+      page_slots[evicted] = UINT32_MAX;
+      write_entry(evicted);
+    }
+
+    u32 slot_x = slot % atlas_pages[atlas], slot_y = slot / atlas_pages[atlas];
+    slots[atlas][slot] = { loaded.page, frame, false };
+    page_slots[loaded.page] = slot;
+    entries[loaded.page] = RESIDENT_BIT | slot_y << 8 | slot_x;
+    was_resident[loaded.page] = 1;
+    write_entry(loaded.page);
+
+    memcpy(page_data + (size_t) uploaded*PAGE_BYTES, loaded.data.data(), PAGE_BYTES);
+    VkBufferImageCopy copy = {};
+    copy.bufferOffset = staging_offset + (VkDeviceSize) uploaded*PAGE_BYTES;
+    copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    copy.imageOffset = { (i32) (slot_x*PAGE_SIZE), (i32) (slot_y*PAGE_SIZE), 0 };
+    copy.imageExtent = { PAGE_SIZE, PAGE_SIZE, 1 };
+    copies[atlas].push_back(copy);
+    ++uploaded;
+  }
+  polled.erase(polled.begin(), polled.begin() + taken);
+
+  if (!entry_copies.empty()) {
+    vmaFlushAllocation(vkallocator, staging.allocation, staging_offset, staging_slice_size());
+    for (u32 a = 0; a < 2; ++a) {
+      if (!copies[a].empty()) vkCmdCopyBufferToImage(cmd, staging.buffer, atlases[a].image, VK_IMAGE_LAYOUT_GENERAL, (u32) copies[a].size(), copies[a].data());
+    }
+    vkCmdCopyBuffer(cmd, staging.buffer, page_table.buffer, (u32) entry_copies.size(), entry_copies.data());
+  }
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void VirtualTextures::end_frame(VkCommandBuffer cmd) {
+  // the host reads this frame's feedback once its fence signaled, NUM_FRAMES frames from now
+  VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void VirtualTextures::fill_desc_infos(VkDescriptorImageInfo atlas_infos[2], VkDescriptorBufferInfo feedback_infos[NUM_FRAMES]) {
+  AllocatedImage::fill_desc_infos(atlases, atlas_infos, 2, VK_IMAGE_LAYOUT_GENERAL);
+  for (u32 f = 0; f < NUM_FRAMES; ++f) {
+    feedback_infos[f] = { feedback.buffer, f*feedback_slice_size, feedback_slice_size };
+  }
+}
@@ -13,32 +13,107 @@
 #include "imgui_impl_glfw.h"
 #include "imgui.h"
 #include "Scene.h"
+#include "MeshCache.h"
+#include "ShaderCache.h"
+#include "AccelCache.h"
+#include "TextureCache.h"
 
 void check_input(GLFWwindow *window, Camera* camera, float dt) {
   if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-    exit(0);
+    glfwSetWindowShouldClose(window, GLFW_TRUE); // leave the render loop so the caches get saved
   }
   camera->check_input(window, dt);
   camera->update_ubo();
 }
 
-void run(GLFWwindow* window);
+struct LaunchArgs {
+  std::string scene_file = "../../../scenes/diningroom.scene";
+  std::string output_file = "render.pfm"; // .pfm writes the linear progressive image, .ppm the tonemapped output
+  u32 spp = 256;
+  u32 width = 0, height = 0; // overrides the scene's Renderer resolution when set
+  bool headless = false;
+  bool compact_blas = false;
+  bool bake_textures = false; // fill the texture cache and exit, needs no gpu
+};
+
+LaunchArgs parse_args(int argc, char** argv) {
+  LaunchArgs args;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--headless") {
+      args.headless = true;
+    } else if (arg == "--spp" && i+1 < argc) {
+      args.spp = (u32) std::max(1, atoi(argv[++i]));
+    } else if (arg == "--output" && i+1 < argc) {
+      args.output_file = argv[++i];
+    } else if (arg == "--resolution" && i+1 < argc) {
+      if (sscanf(argv[++i], "%ux%u", &args.width, &args.height) != 2 || args.width == 0 || args.height == 0) {
+	warn_log("Invalid resolution, expected WIDTHxHEIGHT, {}", argv[i]);
+	args.width = args.height = 0;
+      }
+    } else if (arg == "--compact-blas") {
+      args.compact_blas = true;
+    } else if (arg == "--mesh-cache" && i+1 < argc) {
+      MeshCache::cache_dir = argv[++i];
+    } else if (arg == "--accel-cache" && i+1 < argc) {
+      AccelCache::cache_dir = argv[++i];
+    } else if (arg == "--texture-cache" && i+1 < argc) {
+      TextureCache::cache_dir = argv[++i];
+    } else if (arg == "--bake-textures") {
+      args.bake_textures = true;
+    } else if (arg == "--shader-cache" && i+1 < argc) {
+      ShaderCache::cache_dir = argv[++i];
+    } else if (arg[0] != '-') {
+      args.scene_file = arg;
+    } else {
+      warn_log("Unknown argument, {}", arg);
+    }
+  }
+  return args;
+}
+
+void load_scene(Scene& scene, const LaunchArgs& args);
+void run(GLFWwindow* window, Scene& scene);
+void run_headless(Scene& scene, const LaunchArgs& args);
+
+int main(int argc, char** argv) {
+  LaunchArgs args = parse_args(argc, argv);
+
+  // parsing and mesh loading only touch the cpu, load first so the window can match the scene resolution
+  Scene scene;
+  load_scene(scene, args);
+
+  if (args.bake_textures) {
+    scene.bake_textures();
+    return 0;
+  }
+
+  if (args.headless) {
+    VulkanContext::InitHeadless();
+    run_headless(scene, args);
+    ShaderCache::save_pipeline_cache();
+    return 0;
+  }
 
-int main() {
   u32 glfw_init = glfwInit();
   assert_log(glfw_init, "glfwInit() failed");
 
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
   glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-  GLFWwindow* window = glfwCreateWindow(1920, 1080, "RT Test", nullptr, nullptr);
+  glm::uvec2 resolution = scene.settings.resolution;
+  GLFWwindow* window = glfwCreateWindow((int) resolution.x, (int) resolution.y, "RT Test", nullptr, nullptr);
 
   VulkanContext::InitContext(window);
-  run(window);
+  run(window, scene);
+  VK_CHECK(vkDeviceWaitIdle(vkcontext.device));
+  ShaderCache::save_pipeline_cache();
 }
 
 static RtConfig rt_config { .sample_count = 3, .max_bounce = 5, .gamma = 2.2f, .exposure = 1.0f, .num_lights=1, .frame_count = 0, .show_lights = true, };
 
-void draw_gui(RtProgram& program, Camera* camera) {
+static int tiles_per_frame = 0; // 0 traces every tile, so each presented frame is a full pass
+
+void draw_gui(RtProgram& program, Camera* camera, u32 tile_count) {
   const char* rgen = "../../../shaders/raytrace.rgen";
   const char* rchit = "../../../shaders/raytrace.rchit";
   const char* rmiss = "../../../shaders/raytrace.rmiss";
@@ -65,27 +140,22 @@ void draw_gui(RtProgram& program, Camera* camera) {
   ImGui::SliderFloat("Gamma", &rt_config.gamma, 0, 5);
   ImGui::SliderFloat("Exposure", &rt_config.exposure, 0.0f, 1.0f);
   ImGui::Checkbox("Show Lights", &rt_config.show_lights);
+  if (tile_count > 1) ImGui::SliderInt("Tiles per Frame", &tiles_per_frame, 0, (int) tile_count);
   ImGui::End();
 }
 
-void run(GLFWwindow* window) {
-  Scene scene;
-  std::string filename = "../../../scenes/diningroom.scene";
-  scene.Load_Scene(filename);
+void init_renderer(Scene& scene, AllocatedImage& output_image, AllocatedImage& progressive, DescSet& global_set, RtProgram& rt_program) {
   scene.Build_Structures();
-  rt_config.num_lights = (u32) scene.lights.size();
-  info_log("-- Loaded Scene --");
+  info_log("-- Built Scene --");
 
-  AllocatedImage output_image;
-  AllocatedImage progressive;
-  output_image.create(VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, {1920, 1080, 1});
-  progressive.create(VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, {1920, 1080, 1});
+  VkExtent3D extent = { scene.settings.resolution.x, scene.settings.resolution.y, 1 };
+  output_image.create(VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, extent);
+  progressive.create(VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, extent, 1, VK_FORMAT_R32G32B32A32_SFLOAT);
   vkutil::immediate_submit([&](VkCommandBuffer buffer) {
     output_image.cmdTransitionLayout(buffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
     progressive.cmdTransitionLayout(buffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
   });
 
-  DescSet global_set;
   global_set.add_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // camera
   global_set.add_binding(1, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR); // tlas
   global_set.add_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR); // output image
@@ -102,11 +172,151 @@ void run(GLFWwindow* window) {
   DescSet::update_writes(writes, COUNT_OF(writes));
   
   DescSet sets[] = { global_set, scene.scene_set };
-  RtProgram rt_program;
   rt_program.init_shader_groups("../../../shaders/raytrace.rgen",
 				"../../../shaders/raytrace.rmiss",
 				"../../../shaders/raytrace.rchit", sets, COUNT_OF(sets));
   rt_program.create_sbt();
+}
+
+void load_scene(Scene& scene, const LaunchArgs& args) {
+  std::string filename = args.scene_file;
+  if (!scene.Load_Scene(filename)) {
+    err_log("Failed to load scene, {}", filename);
+    exit(EXIT_FAILURE);
+  }
+  if (args.width != 0) {
+    scene.settings.resolution = { args.width, args.height };
+    scene.camera->set_resolution(scene.settings.resolution);
+  }
+  scene.settings.compact_blas = args.compact_blas;
+  rt_config.num_lights = (u32) scene.lights.size();
+  rt_config.max_bounce = (int) scene.settings.max_depth;
+  info_log("-- Loaded Scene --");
+}
+
+// reads an image back from the gpu, float images are written as .pfm and 8 bit (bgra) images as .ppm
+bool save_image(AllocatedImage& image, const std::string& filename) {
+  u32 width = image.extent.width;
+  u32 height = image.extent.height;
+  bool hdr = image.format == VK_FORMAT_R32G32B32A32_SFLOAT;
+  size_t texel_size = hdr ? 4*sizeof(float) : 4*sizeof(u8);
+
+  AllocatedBuffer readback;
+  readback.create(width*height*texel_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+  vkutil::immediate_submit([&](VkCommandBuffer cmd) {
+    image.cmdTransitionLayout(cmd, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    image.cmdCopyToBuffer(cmd, readback.buffer, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    image.cmdTransitionLayout(cmd, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+  });
+
+  FILE* file = fopen(filename.c_str(), "wb");
+  if (!file) {
+    err_log("Could not open output file, {}", filename);
+    readback.destroy();
+    return false;
+  }
+
+  const u8* pixels = (const u8*) readback.map();
+  if (hdr) {
+    fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+    std::vector<float> row(width*3);
+    for (u32 y = 0; y < height; ++y) {
+      const float* src = (const float*) (pixels + (size_t)(height-1-y)*width*texel_size); // pfm rows go bottom to top
+      for (u32 x = 0; x < width; ++x) {
+	row[3*x+0] = src[4*x+0];
+	row[3*x+1] = src[4*x+1];
+	row[3*x+2] = src[4*x+2];
+      }
+      fwrite(row.data(), sizeof(float), row.size(), file);
+    }
+  } else {
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    std::vector<u8> row(width*3);
+    for (u32 y = 0; y < height; ++y) {
+      const u8* src = pixels + (size_t)y*width*texel_size;
+      for (u32 x = 0; x < width; ++x) {
+	row[3*x+0] = src[4*x+2];
+	row[3*x+1] = src[4*x+1];
+	row[3*x+2] = src[4*x+0];
+      }
+      fwrite(row.data(), 1, row.size(), file);
+    }
+  }
+  readback.unmap();
+  readback.destroy();
+  fclose(file);
+  info_log("Saved image, {}", filename);
+  return true;
+}
+
+void run_headless(Scene& scene, const LaunchArgs& args) {
+  AllocatedImage output_image;
+  AllocatedImage progressive;
+  DescSet global_set;
+  RtProgram rt_program;
+  init_renderer(scene, output_image, progressive, global_set, rt_program);
+
+  // no input in headless mode, upload the camera from the scene once
+  scene.camera->data = scene.camera->ubo.map();
+  scene.camera->update_ubo();
+  memcpy(scene.camera->data, &scene.camera->cameraData, sizeof(CameraData));
+
+  rt_config.sample_count = std::min<int>(rt_config.sample_count, (int) args.spp);
+  u32 frames = (args.spp + rt_config.sample_count - 1) / rt_config.sample_count;
+  std::vector<VkRect2D> tiles = RtProgram::make_tiles(output_image.extent, scene.settings.tile_size);
+  info_log("Rendering {} frames of {} samples in {} tiles", frames, rt_config.sample_count, tiles.size());
+
+  // every tile is its own submit, so no single submit runs long enough to trip the driver watchdog
+  auto trace_pass = [&]() {
+    scene.virtual_textures.poll();
+    for (const VkRect2D& tile : tiles) {
+      auto& frame_data = vkcontext.StartFrame();
+      scene.update_instances(frame_data.cmd_buff);
+      scene.virtual_textures.update(frame_data.cmd_buff);
+      rt_program.bind(frame_data.cmd_buff);
+      DescSet sets[] = {global_set.get_copy(), scene.scene_set.get_copy(), };
+      DescSet::bind_sets(frame_data.cmd_buff, sets, COUNT_OF(sets), rt_program.pl_layout, 0);
+      vkCmdPushConstants(frame_data.cmd_buff, rt_program.pl_layout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RtConfig), &rt_config);
+      rt_program.trace(frame_data.cmd_buff, {&tile, 1});
+      scene.virtual_textures.end_frame(frame_data.cmd_buff);
+      vkcontext.EndFrame();
+    }
+  };
+
+  // texture pages stream in from what the first passes sample. those passes are thrown away until nothing
+  // is loading anymore (feedback is read NUM_FRAMES submits later), so coarse fallback levels are not accumulated
+  const u32 max_warmup_passes = 16;
+  rt_config.frame_count = 0;
+  u32 quiet_passes = 0;
+  for (u32 pass = 0; pass < max_warmup_passes && quiet_passes*tiles.size() <= NUM_FRAMES; ++pass) {
+    trace_pass();
+    quiet_passes = scene.virtual_textures.streaming() ? 0 : quiet_passes + 1;
+  }
+
+  u32 reported = 0;
+  for (u32 frame = 0; frame < frames; ++frame) {
+    rt_config.frame_count = frame;
+    trace_pass();
+
+    u32 percent = (frame+1)*100/frames;
+    if (percent >= reported + 10 || frame+1 == frames) {
+      info_log("Rendered {}/{} frames ({}%)", frame+1, frames, percent);
+      reported = percent;
+    }
+  }
+  VK_CHECK(vkDeviceWaitIdle(vkcontext.device));
+  info_log("Rendered {} samples per pixel", frames*rt_config.sample_count);
+
+  bool tonemapped = args.output_file.size() >= 4 && args.output_file.compare(args.output_file.size()-4, 4, ".ppm") == 0;
+  save_image(tonemapped ? output_image : progressive, args.output_file);
+}
+
+void run(GLFWwindow* window, Scene& scene) {
+  AllocatedImage output_image;
+  AllocatedImage progressive;
+  DescSet global_set;
+  RtProgram rt_program;
+  init_renderer(scene, output_image, progressive, global_set, rt_program);
 
   glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
@@ -125,33 +335,57 @@ void run(GLFWwindow* window) {
   });
   scene.camera->data = scene.camera->ubo.map();
 
+  std::vector<VkRect2D> tiles = RtProgram::make_tiles(output_image.extent, scene.settings.tile_size);
+  u32 next_tile = 0;
+
   double prevTime = glfwGetTime();
   float dt = 0;
   while (!glfwWindowShouldClose(window)) {
     glfwPollEvents();
     
     dt = (float)(glfwGetTime() - prevTime);
-    if(scene.camera->frame_count <= 1e9) ++scene.camera->frame_count;
     check_input(window, scene.camera, dt);
-    rt_config.frame_count = scene.camera->frame_count;
 
     ImGui_ImplGlfw_NewFrame();
     ImGui_ImplVulkan_NewFrame();
     ImGui::NewFrame();
-    draw_gui(rt_program, scene.camera);
+    draw_gui(rt_program, scene.camera, (u32) tiles.size());
     ImGui::Render();
+
+    // shaders rebuild in the background (file watcher or the reload buttons), a new pipeline restarts accumulation
+    if (rt_program.poll_reload()) scene.camera->frame_count = 0;
+    // moved instances are refit into the tlas below, the old samples no longer match the scene
+    scene.animate((float) glfwGetTime());
+    if (scene.tlas.needs_update()) scene.camera->frame_count = 0;
+    // texture pages that arrived for the first time replace the coarser levels the old samples were shaded with
+    if (scene.virtual_textures.poll()) scene.camera->frame_count = 0;
+
+    // a pass traces every tile once and may span several presented frames,
+    // accumulation only advances when a new pass starts. moving the camera or restarting starts over
+    if (scene.camera->frame_count == 0) next_tile = 0;
+    if (next_tile == 0 && scene.camera->frame_count <= 1e9) ++scene.camera->frame_count;
+    rt_config.frame_count = scene.camera->frame_count - 1;
+
+    u32 tile_budget = tiles_per_frame == 0 ? (u32) tiles.size() : (u32) tiles_per_frame;
+    u32 tile_count = std::min(tile_budget, (u32) tiles.size() - next_tile);
+    std::span<const VkRect2D> frame_tiles(tiles.data() + next_tile, tile_count);
+    next_tile = (next_tile + tile_count) % (u32) tiles.size();
+
     VkRenderPassBeginInfo begin_info = { VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
     begin_info.clearValueCount = 0;
     begin_info.renderPass = vkcontext.swapchain.render_pass;
     begin_info.renderArea.offset = { 0, 0 };
-    begin_info.renderArea.extent = { 1920, 1080 };
+    begin_info.renderArea.extent = vkcontext.swapchain.extent;
 
     auto& frame_data = vkcontext.StartFrame();
+    scene.update_instances(frame_data.cmd_buff);
+    scene.virtual_textures.update(frame_data.cmd_buff);
     rt_program.bind(frame_data.cmd_buff);
     DescSet sets[] = {global_set.get_copy(), scene.scene_set.get_copy(), };
     DescSet::bind_sets(frame_data.cmd_buff, sets, COUNT_OF(sets), rt_program.pl_layout, 0);
     vkCmdPushConstants(frame_data.cmd_buff, rt_program.pl_layout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RtConfig), &rt_config);
-    rt_program.render_to_swapchain(frame_data, output_image);
+    rt_program.render_to_swapchain(frame_data, output_image, frame_tiles);
+    scene.virtual_textures.end_frame(frame_data.cmd_buff);
 
     begin_info.framebuffer = vkcontext.swapchain.images[vkcontext.swapchain.image_index].fbo;
     vkCmdBeginRenderPass(frame_data.cmd_buff, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
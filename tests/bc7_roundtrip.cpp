@@ -0,0 +1,77 @@
+// encodes single 4x4 blocks with BcEncoder::encode_bc7, decodes them as bc7 mode 6 and checks the error.
+// exits non zero on failure, run through ctest
+#include "BcEncoder.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const u32 bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static u32 read_bits(const u8* block, u32& pos, u32 count) {
+  u32 value = 0;
+  for (u32 i = 0; i < count; ++i, ++pos) value |= ((block[pos / 8] >> (pos % 8)) & 1) << i;
+  return value;
+}
+
+static bool decode_bc7_mode6(const u8 block[16], u8 out[16][4]) {
+  u32 pos = 0;
+  if (read_bits(block, pos, 7) != 1 << 6) return false;
+  u32 endpoints[2][4];
+  for (u32 c = 0; c < 4; ++c) {
+    endpoints[0][c] = read_bits(block, pos, 7) << 1;
+    endpoints[1][c] = read_bits(block, pos, 7) << 1;
+  }
+  u32 p0 = read_bits(block, pos, 1), p1 = read_bits(block, pos, 1);
+  for (u32 c = 0; c < 4; ++c) {
+    endpoints[0][c] |= p0;
+    endpoints[1][c] |= p1;
+  }
+  for (u32 i = 0; i < 16; ++i) {
+    u32 w = bc7_weights[read_bits(block, pos, i == 0 ? 3 : 4)];
+    for (u32 c = 0; c < 4; ++c) out[i][c] = (u8) (((64 - w) * endpoints[0][c] + w * endpoints[1][c] + 32) >> 6);
+  }
+  return true;
+}
+
+static bool round_trip(const char* name, const u8 texels[16][4], int tolerance) {
+  u8 block[16];
+  BcEncoder::encode_bc7(&texels[0][0], 4, 4, block);
+  u8 decoded[16][4];
+  if (!decode_bc7_mode6(block, decoded)) {
+    printf("%s: not a mode 6 block\n", name);
+    return false;
+  }
+  int worst = 0;
+  for (u32 i = 0; i < 16; ++i) {
+    for (u32 c = 0; c < 4; ++c) worst = std::max(worst, abs((int) decoded[i][c] - (int) texels[i][c]));
+  }
+  printf("%s: max error %d\n", name, worst);
+  return worst <= tolerance;
+}
+
+int main() {
+  u8 texels[16][4];
+  bool ok = true;
+
+  // constant color, alpha ramps across the block. the rgb only power iteration seed used to flatten the alpha
+  for (u32 i = 0; i < 16; ++i) {
+    texels[i][0] = 200; texels[i][1] = 120; texels[i][2] = 40;
+    texels[i][3] = (u8) (i * 17);
+  }
+  ok &= round_trip("alpha gradient", texels, 12);
+
+  // opaque grey ramp
+  for (u32 i = 0; i < 16; ++i) {
+    texels[i][0] = texels[i][1] = texels[i][2] = (u8) (i * 16);
+    texels[i][3] = 255;
+  }
+  ok &= round_trip("grey gradient", texels, 12);
+
+  // uniform block
+  for (u32 i = 0; i < 16; ++i) {
+    texels[i][0] = 10; texels[i][1] = 20; texels[i][2] = 30; texels[i][3] = 255;
+  }
+  ok &= round_trip("uniform", texels, 2);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}